@@ -1,5 +1,5 @@
 #!/bin/sh
 exec clang -std=c11 -o naclypt \
    -W{everything,no-disabled-macro-expansion,no-reserved-id-macro} \
-   -O3 -flto -fuse-ld=gold -march=native \
+   -O3 -flto -fuse-ld=gold -march=native -pthread \
    naclypt.c -l{argon2,sodium}
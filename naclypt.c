@@ -1,15 +1,44 @@
-#define _DEFAULT_SOURCE
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
 #include <inttypes.h>
+#include <limits.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/file.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/mount.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/sysmacros.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <linux/fuse.h>
+#include <linux/errqueue.h>
+#include <linux/ioprio.h>
+#include <linux/mempolicy.h>
+#include <linux/userfaultfd.h>
+
 #include <argon2.h>
+#include <sodium/crypto_generichash.h>
+#include <sodium/crypto_hash_sha256.h>
 #include <sodium/crypto_secretbox.h>
 
 #define LIKELY(x) __builtin_expect((x), 1)
@@ -17,10 +46,121 @@
 
 #define BUFLEN (8 * 1024 * 1024)
 
+// Every chunk but the last is sealed into a box of exactly BUFLEN octets
+// holding CHUNKLEN octets of plaintext, so where a chunk goes in either stream
+// is a function of its index alone.
+#define CHUNKLEN (BUFLEN - crypto_secretbox_ZEROBYTES)
+
+// Encrypting starts a new nonce (see below) every this many chunks.
+#define NONCE_CHUNKS ((INT32_MAX - 1) / CHUNKLEN + 2)
+
+// The magic, logM, t, p, and the salt.
+#define HEADERLEN \
+   (sizeof crypto_secretbox_PRIMITIVE + 1 + 4 + 4 + crypto_secretbox_KEYBYTES)
+
+// --checkpoint-every's default: a checkpoint per GiB or so of output.
+#define CHECKPOINT_EVERY 128
+
+// Format flags, XORed into the last octet of the magic, otherwise the NUL
+// terminating crypto_secretbox_PRIMITIVE, so that older versions refuse files
+// using them.
+//
+// FLAG_FRAMED: each box is preceded by its length as a 4-octet big-endian
+// integer rather than being BUFLEN octets but for the last, and the boxes end
+// with an empty one, whose authenticity is checked, as a trailer. For
+// --follow, which seals whatever it has when it has waited long enough.
+//
+// FLAG_MERKLE: the boxes are followed by a tree over their tags; see
+// MERKLE_FOOTER.
+//
+// FLAG_STORE: the plaintext is a --store manifest: the number of chunks as an
+// 8-octet big-endian integer, followed by the names of the chunks in the store.
+#define FLAG_CHUNK_NONCES 0x01U
+#define FLAG_FRAMED 0x02U
+#define FLAG_MERKLE 0x04U
+#define FLAG_STORE 0x08U
+#define KNOWN_FLAGS (FLAG_CHUNK_NONCES | FLAG_FRAMED | FLAG_MERKLE | FLAG_STORE)
+
+// With --records, the boxes hold at most this many octets, records being
+// split if need be.
+#define RECORD_BUFLEN (64 * 1024)
+
+// --flush-after's default, in seconds.
+#define FLUSH_AFTER 1
+
+// With --follow, without inotify, how often to look for more of a regular
+// file, in nanoseconds.
+#define FOLLOW_POLL 100000000
+
+// --follow-timeout's default, in seconds.
+#define FOLLOW_TIMEOUT 60
+
+#define MAX_JOBS 1024
+
+// The most threads -j defaults to, however many CPUs there are, since each
+// has two chunks, 32 MiB, mlocked.
+#define DEFAULT_JOBS 4
+
+// The size of the digests, of the leaves and roots of their trees alike.
+#define DIGESTLEN 32
+
+// For --merkle: after the last box come the nodes of a BLAKE2b tree over the
+// boxes' tags, leaves first and then each level above, and then this footer:
+// a nonce, the root and the number of chunks sealed with it, and that number
+// again in the clear so that the tree can be found.
+#define MERKLE_FOOTER \
+   (crypto_secretbox_NONCEBYTES + crypto_secretbox_MACBYTES + DIGESTLEN + 8 \
+  + 8)
+
+// The most --tee destinations, and --tee-lag's default in chunks.
+#define MAX_TEES 16
+#define TEE_LAG 4
+
+// The most --volume-dir directories.
+#define MAX_VOLUME_DIRS 16
+
+// --mount-cache's default in chunks, the most plaintext each read --mount
+// serves may ask for, the most chunks that can span, and the room for each
+// request.
+#define MOUNT_CACHE 16
+#define MOUNT_MAX_READ (1024 * 1024)
+#define MOUNT_READ_CHUNKS (MOUNT_MAX_READ / CHUNKLEN + 2)
+#define MOUNT_REQUEST (64 * 1024)
+
+// --shared-cache-size's default in chunks, and what a shared cache starts
+// with, so that its layout can't be mistaken for another's.
+#define SHARED_CACHE 32
+#define SHARED_MAGIC "naclypt shared cache 1"
+
+// How many --connect sends can be tracked at once, a power of two.
+#define ZEROCOPY_WINDOW 65536
+
+// The highest NUMA node number we handle, plus one.
+#define MAX_NODES 1024
+
+// Rate limited I/O is done in pieces of at most this many octets, so that it
+// doesn't come in bursts of whole chunks.
+#define THROTTLE_PIECE (1024 * 1024)
+
+// With --numa, the main thread reads this many chunks into one node's
+// buffers before moving on to the next node.
+#define NUMA_BATCH 4
+
+// The workers, and --mount's threads, do little more than call into
+// libsodium, so they don't need (nor do we want to mlock) the default 8 MiB
+// stacks.
+#define STACKLEN (256 * 1024)
+
 // We will store random nonce data in the zeroes in the output (guaranteed to
 // us by BOXZEROBYTES). If we have room for more than BOXZEROBYTES in the
 // nonce, we use the number of octets written thus far in total. The rest will
 // be zero.
+//
+// Originally that total was only filled in when a new nonce was started, and
+// the chunks after it reused its nonce. With FLAG_CHUNK_NONCES, every chunk
+// fills in its own, and any chunk whose zeroes aren't all zero starts a new
+// nonce with them, so that a chunk can be sealed again (see --append) with
+// new random data in place of the old.
 static const size_t NONCE_RANDOMS =
    crypto_secretbox_BOXZEROBYTES < crypto_secretbox_NONCEBYTES
       ? crypto_secretbox_BOXZEROBYTES
@@ -33,46 +173,4321 @@ static size_t read_full(FILE *f, unsigned char *buf, size_t n) {
       r += x;
       if (UNLIKELY(!x))
          break;
-   }
-   return r;
-}
-
-static size_t write_full(FILE *f, unsigned char *buf, size_t n) {
-   size_t w = 0;
-   while (w < n) {
-      const size_t x = fwrite_unlocked(buf + w, 1, n - w, f);
-      w += x;
-      if (UNLIKELY(!x))
+   }
+   return r;
+}
+
+static size_t write_full(FILE *f, unsigned char *buf, size_t n) {
+   size_t w = 0;
+   while (w < n) {
+      const size_t x = fwrite_unlocked(buf + w, 1, n - w, f);
+      w += x;
+      if (UNLIKELY(!x))
+         break;
+   }
+   return w;
+}
+
+static size_t pwrite_full(int fd, unsigned char *buf, size_t n, off_t off) {
+   size_t w = 0;
+   while (w < n) {
+      const ssize_t x = pwrite(fd, buf + w, n - w, off + (off_t)w);
+      if (UNLIKELY(x <= 0)) {
+         if (x && errno == EINTR)
+            continue;
+         break;
+      }
+      w += (size_t)x;
+   }
+   return w;
+}
+
+static size_t write_fd_full(int fd, const unsigned char *buf, size_t n) {
+   size_t w = 0;
+   while (w < n) {
+      const ssize_t x = write(fd, buf + w, n - w);
+      if (UNLIKELY(x <= 0)) {
+         if (x && errno == EINTR)
+            continue;
+         break;
+      }
+      w += (size_t)x;
+   }
+   return w;
+}
+
+static size_t pread_full(int fd, unsigned char *buf, size_t n, off_t off) {
+   size_t r = 0;
+   while (r < n) {
+      const ssize_t x = pread(fd, buf + r, n - r, off + (off_t)r);
+      if (UNLIKELY(x <= 0)) {
+         if (x && errno == EINTR)
+            continue;
+         break;
+      }
+      r += (size_t)x;
+   }
+   return r;
+}
+
+static void fill_in_nonce(unsigned char *nonce, uint_fast64_t total_read) {
+   uint_fast64_t n = total_read;
+   ssize_t missing = (ssize_t)crypto_secretbox_NONCEBYTES
+                   - (ssize_t)crypto_secretbox_BOXZEROBYTES;
+   for (size_t i = 0; i < sizeof n && missing > 0; --missing, ++i) {
+      nonce[crypto_secretbox_BOXZEROBYTES + i] = (uint8_t)n;
+      n >>= 8;
+   }
+}
+
+static void put_be64(unsigned char *buf, uint_fast64_t n) {
+   for (size_t i = 8; i--;) {
+      buf[i] = (uint8_t)n;
+      n >>= 8;
+   }
+}
+
+static uint_fast64_t get_be64(const unsigned char *buf) {
+   uint_fast64_t n = 0;
+   for (size_t i = 0; i < 8; ++i)
+      n = n << 8 | buf[i];
+   return n;
+}
+
+static bool is_zero(const unsigned char *buf, size_t n) {
+   for (size_t i = 0; i < n; ++i) {
+      if (buf[i])
+         return false;
+   }
+   return true;
+}
+
+struct node {
+   cpu_set_t cpus;
+   size_t workers, readers, chunks;
+   int id;
+   char pad[4];
+};
+
+static bool read_cpulist(const char *path, cpu_set_t *cpus) {
+   FILE *f = fopen(path, "r");
+   if (!f)
+      return false;
+   char buf[4096];
+   const bool ok = fgets(buf, sizeof buf, f);
+   fclose(f);
+   if (!ok)
+      return false;
+
+   CPU_ZERO(cpus);
+   for (char *s = buf, *end; *s && *s != '\n'; s = end + (*end == ',')) {
+      unsigned long lo = strtoul(s, &end, 10), hi = lo;
+      if (end == s)
+         return false;
+      if (*end == '-') {
+         hi = strtoul(s = end + 1, &end, 10);
+         if (end == s)
+            return false;
+      }
+      for (; lo <= hi && lo < CPU_SETSIZE; ++lo)
+         CPU_SET(lo, cpus);
+   }
+   return true;
+}
+
+static void print_cpus(const cpu_set_t *cpus) {
+   const char *sep = "";
+   for (size_t lo = 0; lo < CPU_SETSIZE; ++lo) {
+      if (!CPU_ISSET(lo, cpus))
+         continue;
+      size_t hi = lo;
+      while (hi + 1 < CPU_SETSIZE && CPU_ISSET(hi + 1, cpus))
+         ++hi;
+      if (hi == lo)
+         fprintf(stderr, "%s%zu", sep, lo);
+      else
+         fprintf(stderr, "%s%zu-%zu", sep, lo, hi);
+      sep = ",";
+      lo = hi;
+   }
+}
+
+static int node_cmp(const void *a, const void *b) {
+   const struct node *x = a, *y = b;
+   return (x->id > y->id) - (x->id < y->id);
+}
+
+// Finds the NUMA nodes that have CPUs we're allowed to run on. Returns how
+// many there are, or zero if there's only one or we can't tell.
+static size_t find_nodes(struct node **nodes) {
+   cpu_set_t allowed;
+   DIR *dir;
+   if (sched_getaffinity(0, sizeof allowed, &allowed)
+    || !(dir = opendir("/sys/devices/system/node")))
+      return 0;
+
+   struct node *v = NULL;
+   size_t n = 0;
+   for (struct dirent *d; (d = readdir(dir));) {
+      int id;
+      char c, path[64];
+      if (sscanf(d->d_name, "node%d%c", &id, &c) != 1 || id < 0
+       || id >= MAX_NODES)
+         continue;
+      snprintf(path, sizeof path, "/sys/devices/system/node/node%d/cpulist",
+               id);
+
+      cpu_set_t cpus;
+      if (!read_cpulist(path, &cpus))
+         continue;
+      CPU_AND(&cpus, &cpus, &allowed);
+      if (!CPU_COUNT(&cpus))
+         continue;
+
+      struct node *w = realloc(v, (n + 1) * sizeof *v);
+      if (!w)
+         break;
+      v = w;
+      v[n++] = (struct node){.id = id, .cpus = cpus};
+   }
+   closedir(dir);
+
+   if (n < 2) {
+      free(v);
+      return 0;
+   }
+   qsort(v, n, sizeof *v, node_cmp);
+   *nodes = v;
+   return n;
+}
+
+// Sets the memory policy of the calling thread to mode over the given nodes.
+// Failing is harmless, so it's ignored.
+static void set_policy(int mode, const struct node *nodes, size_t n) {
+   unsigned long mask[MAX_NODES / (8 * sizeof(unsigned long))] = {0};
+   const size_t bits = 8 * sizeof *mask;
+   for (size_t i = 0; i < n; ++i)
+      mask[(size_t)nodes[i].id / bits] |= 1UL << ((size_t)nodes[i].id % bits);
+   (void) syscall(SYS_set_mempolicy, mode, n ? mask : NULL,
+                  n ? MAX_NODES + 1 : 0);
+}
+
+// How many CPUs' worth of time we can use: the number of CPUs we may run on,
+// or less if a cgroup v2 CPU quota applies to us or any of our ancestors.
+static size_t usable_cpus(bool verbose) {
+   cpu_set_t cpus;
+   size_t n = sched_getaffinity(0, sizeof cpus, &cpus)
+            ? 1 : (size_t)CPU_COUNT(&cpus);
+   if (verbose)
+      fprintf(stderr, "%zu CPUs in our affinity mask\n", n);
+
+   char cgroup[4096], path[4200];
+   FILE *f = fopen("/proc/self/cgroup", "r");
+   if (!f)
+      return n;
+   bool found = false;
+   while (!found && fgets(cgroup, sizeof cgroup, f))
+      found = !strncmp(cgroup, "0::", 3);
+   fclose(f);
+   if (!found)
+      return n;
+   cgroup[strcspn(cgroup, "\n")] = '\0';
+
+   char *dir = cgroup + 3;
+   do {
+      unsigned long long quota, period;
+      snprintf(path, sizeof path, "/sys/fs/cgroup%s/cpu.max", dir);
+      if ((f = fopen(path, "r"))) {
+         if (fscanf(f, "%llu %llu", &quota, &period) == 2 && period) {
+            const size_t q = (size_t)((quota + period - 1) / period);
+            if (verbose)
+               fprintf(stderr, "%s allows %zu CPUs\n", path, q);
+            if (q < n)
+               n = q;
+         }
+         fclose(f);
+      }
+      char *slash = strrchr(dir, '/');
+      if (!slash)
+         break;
+      *slash = '\0';
+   } while (*dir);
+   return n ? n : 1;
+}
+
+struct throttle {
+   pthread_mutex_t lock;
+
+   // In octets per nanosecond, or zero if unlimited.
+   double rate;
+
+   // The CLOCK_MONOTONIC time by which everything so far may have been done.
+   uint_fast64_t at;
+};
+
+static uint_fast64_t now_ns(void) {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint_fast64_t)ts.tv_sec * 1000000000 + (uint_fast64_t)ts.tv_nsec;
+}
+
+// Waits until another n octets fit in the rate. After idling, one
+// THROTTLE_PIECE may go through at once.
+static void throttle(struct throttle *t, size_t n) {
+   pthread_mutex_lock(&t->lock);
+   const uint_fast64_t now = now_ns(),
+                       slack = (uint_fast64_t)(THROTTLE_PIECE / t->rate);
+   if (t->at + slack < now)
+      t->at = now - slack;
+   const uint_fast64_t start = t->at;
+   t->at += (uint_fast64_t)((double)n / t->rate);
+   pthread_mutex_unlock(&t->lock);
+
+   if (start <= now)
+      return;
+   const struct timespec ts = {
+      .tv_sec = (time_t)(start / 1000000000),
+      .tv_nsec = (long)(start % 1000000000),
+   };
+   while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+      ;
+}
+
+struct chunk {
+   struct chunk *next;
+   unsigned char *ibuf, *obuf;
+   uint_fast64_t idx;
+   size_t len, node;
+
+   // For --connect: the kernel is done with obuf once zc_done reaches this.
+   uint_fast64_t zc_end;
+
+   unsigned char nonce[crypto_secretbox_NONCEBYTES];
+   unsigned char reseal_nonce[crypto_secretbox_NONCEBYTES];
+   unsigned char plain_leaf[DIGESTLEN], cipher_leaf[DIGESTLEN];
+   unsigned char id[DIGESTLEN];
+   bool new_nonce, trailer, stored, reseal_new_nonce;
+   char pad[4];
+};
+
+// --plain-digest and --cipher-digest hash each chunk on the worker that has
+// it, and the root hashes those leaves in order. The cipher digest's first
+// leaf is the header.
+struct digest {
+   union {
+      crypto_generichash_state blake2b;
+      crypto_hash_sha256_state sha256;
+   } root;
+   enum { DIGEST_NONE, DIGEST_BLAKE2B, DIGEST_SHA256 } alg;
+
+   // The BLAKE2b state is aligned to 64 octets.
+   char pad[64 - sizeof(int)];
+};
+
+static const char *const digest_names[] = {
+   [DIGEST_BLAKE2B] = "blake2b",
+   [DIGEST_SHA256] = "sha256",
+};
+
+static void digest_leaf(const struct digest *d, unsigned char *leaf,
+                        const unsigned char *buf, size_t n)
+{
+   if (d->alg == DIGEST_SHA256)
+      crypto_hash_sha256(leaf, buf, n);
+   else
+      crypto_generichash(leaf, DIGESTLEN, buf, n, NULL, 0);
+}
+
+static void digest_start(struct digest *d) {
+   if (d->alg == DIGEST_SHA256)
+      crypto_hash_sha256_init(&d->root.sha256);
+   else if (d->alg)
+      crypto_generichash_init(&d->root.blake2b, NULL, 0, DIGESTLEN);
+}
+
+static void digest_add(struct digest *d, const unsigned char *leaf) {
+   if (d->alg == DIGEST_SHA256)
+      crypto_hash_sha256_update(&d->root.sha256, leaf, DIGESTLEN);
+   else if (d->alg)
+      crypto_generichash_update(&d->root.blake2b, leaf, DIGESTLEN);
+}
+
+static void digest_end(struct digest *d, unsigned char *out) {
+   if (d->alg == DIGEST_SHA256)
+      crypto_hash_sha256_final(&d->root.sha256, out);
+   else
+      crypto_generichash_final(&d->root.blake2b, out, DIGESTLEN);
+}
+
+// For --merkle: how many nodes a tree over n chunks has. Each level has half
+// as many as the one below, an odd one out going up as is.
+static size_t merkle_nodes(uint_fast64_t n) {
+   size_t nodes = 0;
+   for (; n > 1; n = (n + 1) / 2)
+      nodes += n;
+   return nodes + n;
+}
+
+// Leaves hash a tag and inner nodes the two below them, told apart by kind.
+static void merkle_hash(unsigned char *out, unsigned char kind,
+                        const unsigned char *buf, size_t n)
+{
+   crypto_generichash_state s;
+   crypto_generichash_init(&s, NULL, 0, DIGESTLEN);
+   crypto_generichash_update(&s, &kind, 1);
+   crypto_generichash_update(&s, buf, n);
+   crypto_generichash_final(&s, out, DIGESTLEN);
+}
+
+// Fills in the levels above the n leaves at the start of tree, and root.
+static void merkle_build(unsigned char *tree, uint_fast64_t n,
+                         unsigned char *root)
+{
+   unsigned char *below = tree;
+   for (; n > 1; n = (n + 1) / 2) {
+      unsigned char *above = below + n * DIGESTLEN;
+      for (uint_fast64_t i = 0; i + 1 < n; i += 2)
+         merkle_hash(above + i / 2 * DIGESTLEN, 1, below + i * DIGESTLEN,
+                     2 * DIGESTLEN);
+      if (n % 2)
+         memcpy(above + n / 2 * DIGESTLEN, below + (n - 1) * DIGESTLEN,
+                DIGESTLEN);
+      below = above;
+   }
+   if (n)
+      memcpy(root, below, DIGESTLEN);
+   else
+      merkle_hash(root, 0, NULL, 0);
+}
+
+// A --tee destination, written to by a thread of its own.
+struct tee {
+   struct engine *e;
+   const char *name;
+
+   // The index of the next chunk to write.
+   uint_fast64_t next;
+
+   int fd;
+   char pad[4];
+};
+
+// For --volume-size and --volumes: the encrypted file split into volumes of
+// per_volume boxes each, the first also having the header at base. Volume i
+// is prefix.00i, in dirs[i % ndirs] if there are any. n of them are open, in
+// fds with room for cap, the first being stdout or in_fd.
+struct volumes {
+   const char *prefix;
+   const char *const *dirs;
+   size_t ndirs, n, cap;
+   uint_fast64_t per_volume;
+   off_t base;
+   int *fds;
+};
+
+static void volume_path(char *path, const struct volumes *v, size_t i) {
+   if (v->ndirs) {
+      const char *slash = strrchr(v->prefix, '/');
+      snprintf(path, PATH_MAX, "%s/%s.%03zu", v->dirs[i % v->ndirs],
+               slash ? slash + 1 : v->prefix, i);
+   } else {
+      snprintf(path, PATH_MAX, "%s.%03zu", v->prefix, i);
+   }
+}
+
+// For --shared-cache: plaintext chunks in shared memory, each in a slot named
+// by id, a keyed hash of its nonce and MAC. A slot's seq is odd while the
+// slot is being written and zero until it first has been, so that readers can
+// look up chunks without locking, and tell whether one changed under them.
+// Slots are taken for new chunks as the hand sweeps past them, unless used
+// since it last did. users is the number of processes attached, the last of
+// which to detach unlinks it, so that the plaintext doesn't outlive them.
+struct shared_slot {
+   uint64_t seq;
+   uint32_t len, used;
+   unsigned char id[DIGESTLEN];
+};
+
+struct shared_head {
+   char magic[(sizeof SHARED_MAGIC + 7) / 8 * 8];
+   uint64_t nslots, hand, users;
+};
+
+struct shared {
+   const char *name;
+   unsigned char *base;
+   size_t len, nslots;
+   struct shared_head *head;
+   struct shared_slot *slots;
+   unsigned char *data;
+   int fd;
+   char pad[4];
+};
+
+// The shared cache to detach from at exit.
+static struct shared *attached;
+
+static void shared_detach(void) {
+   if (!flock(attached->fd, LOCK_EX) && !--attached->head->users)
+      (void) shm_unlink(attached->name);
+   (void) flock(attached->fd, LOCK_UN);
+}
+
+// Opens the shared cache called name, creating it with room for nslots
+// chunks if it doesn't exist, or else using it however large it is, and
+// attaches to it until exit. s must outlive main. Returns the exit status
+// for main.
+static int shared_open(struct shared *s, const char *name, size_t nslots) {
+   const int fd = shm_open(name, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+   if (fd < 0) {
+      fprintf(stderr, "Couldn't open shared cache %s: %s\n", name,
+              strerror(errno));
+      return 1;
+   }
+
+   // Whoever finds it empty sizes it and writes its head, which no one else
+   // may see half done. The data starts on a page of its own.
+   const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+   struct stat st;
+   bool ok = !flock(fd, LOCK_EX) && !fstat(fd, &st);
+   const bool empty = ok && !st.st_size;
+   if (empty) {
+      s->len = (sizeof *s->head + nslots * sizeof *s->slots + page - 1)
+             / page * page + nslots * CHUNKLEN;
+      ok = !ftruncate(fd, (off_t)s->len);
+   } else {
+      s->len = (size_t)st.st_size;
+   }
+   if (!ok) {
+      fprintf(stderr, "Couldn't set up shared cache %s: %s\n", name,
+              strerror(errno));
+      close(fd);
+      return 1;
+   }
+   s->base = mmap(NULL, s->len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   if (s->base == MAP_FAILED) {
+      perror("Couldn't map shared cache");
+      close(fd);
+      return 4;
+   }
+   s->head = (struct shared_head *)(void *)s->base;
+   if (empty) {
+      memcpy(s->head->magic, SHARED_MAGIC, sizeof SHARED_MAGIC);
+      s->head->nslots = nslots;
+   }
+
+   s->slots = (struct shared_slot *)(void *)(s->head + 1);
+   s->nslots = s->len < page ? 0 : (size_t)s->head->nslots;
+   if (!s->nslots || memcmp(s->head->magic, SHARED_MAGIC, sizeof SHARED_MAGIC)
+    || s->nslots > (s->len - page) / CHUNKLEN
+    || s->nslots * sizeof *s->slots + sizeof *s->head
+       > s->len - s->nslots * CHUNKLEN)
+   {
+      fprintf(stderr, "%s isn't a shared cache\n", name);
+      close(fd);
+      return 1;
+   }
+   // Without users, it was unlinked by the last of them after being opened
+   // here, and so is no longer name.
+   if (!empty && !s->head->users) {
+      close(fd);
+      munmap(s->base, s->len);
+      return shared_open(s, name, nslots);
+   }
+   ++s->head->users;
+   (void) flock(fd, LOCK_UN);
+   s->data = s->base + s->len - s->nslots * CHUNKLEN;
+   s->name = name;
+   s->fd = fd;
+   attached = s;
+   if (atexit(shared_detach)) {
+      fputs("Couldn't set up detaching from the shared cache\n", stderr);
+      shared_detach();
+      return 3;
+   }
+   return 0;
+}
+
+static void shared_id(const unsigned char *key, const unsigned char *nonce,
+                      const unsigned char *box, unsigned char *id)
+{
+   unsigned char in[crypto_secretbox_NONCEBYTES + crypto_secretbox_MACBYTES];
+   memcpy(in, nonce, crypto_secretbox_NONCEBYTES);
+   memcpy(in + crypto_secretbox_NONCEBYTES,
+          box + crypto_secretbox_BOXZEROBYTES, crypto_secretbox_MACBYTES);
+   crypto_generichash(id, DIGESTLEN, in, sizeof in, key,
+                      crypto_secretbox_KEYBYTES);
+}
+
+// Copies the len octets of plaintext of chunk id to buf, if the cache has
+// exactly that.
+static bool shared_get(struct shared *s, const unsigned char *id,
+                       unsigned char *buf, size_t len)
+{
+   for (size_t i = 0; i < s->nslots; ++i) {
+      struct shared_slot *slot = &s->slots[i];
+      const uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+      if (!seq || seq & 1 || slot->len != len
+       || memcmp(slot->id, id, DIGESTLEN))
+         continue;
+      memcpy(buf, s->data + i * CHUNKLEN, len);
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq)
+         continue;
+      __atomic_store_n(&slot->used, 1, __ATOMIC_RELAXED);
+      return true;
+   }
+   return false;
+}
+
+// Puts the len octets in buf in the cache as chunk id, unless every slot is
+// being written to.
+static void shared_put(struct shared *s, const unsigned char *id,
+                       const unsigned char *buf, size_t len)
+{
+   for (size_t tries = 0; tries < 2 * s->nslots + 1; ++tries) {
+      const size_t i = (size_t)(__atomic_fetch_add(&s->head->hand, 1,
+                                                   __ATOMIC_RELAXED)
+                                % s->nslots);
+      struct shared_slot *slot = &s->slots[i];
+      if (__atomic_exchange_n(&slot->used, 0, __ATOMIC_RELAXED))
+         continue;
+      uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+      if (seq & 1 || !__atomic_compare_exchange_n(&slot->seq, &seq, seq + 1,
+                                                  false, __ATOMIC_ACQUIRE,
+                                                  __ATOMIC_RELAXED))
+         continue;
+      __atomic_thread_fence(__ATOMIC_RELEASE);
+      memcpy(slot->id, id, DIGESTLEN);
+      slot->len = (uint32_t)len;
+      memcpy(s->data + i * CHUNKLEN, buf, len);
+      __atomic_store_n(&slot->used, 1, __ATOMIC_RELAXED);
+      __atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+      return;
+   }
+}
+
+// Chunks are handed out in order, since their nonces depend on everything
+// before them, and read by the main thread or, when the input allows it, by
+// several positional readers at once. The workers seal or open them and, when
+// out_base isn't negative, pwrite them straight into place. Otherwise,
+// whichever worker finishes the next chunk in line writes it out along with
+// any later ones that were waiting on it.
+struct engine {
+   // First, as the most strictly aligned.
+   struct digest plain_digest, cipher_digest;
+
+   pthread_mutex_t lock;
+   pthread_cond_t cond;
+
+   // Chunks go from free to queue once read, to done once sealed or opened,
+   // and back to free once written out everywhere: all chunks below
+   // released have been. done is indexed by idx % nchunks.
+   struct chunk *free, *queue, **queue_tail, **done;
+   size_t nchunks;
+   uint_fast64_t released;
+
+   // For --tee. Each destination can fall behind the others by as many
+   // chunks as there are to spare; tee_lag more are allocated for that.
+   struct tee *tees;
+   size_t ntees, tee_lag;
+
+   // All chunks below this index have been written out. The output starts
+   // with first_idx, not necessarily zero.
+   uint_fast64_t written, first_idx;
+   uint_fast64_t out_len;
+
+   const unsigned char *key;
+
+   // For --transcode, which decrypts under key: the key to seal the chunks
+   // again under, and the nonce schedule for that, as when encrypting.
+   const unsigned char *reseal_key;
+   unsigned char reseal_nonce[crypto_secretbox_NONCEBYTES];
+   int_fast32_t reseal_in;
+
+   // For --deterministic: the key of the hash that gives each chunk the
+   // random part of its nonce.
+   unsigned char nonce_key[crypto_generichash_KEYBYTES];
+
+   // For --merkle: the tags of the chunks written so far, with room for
+   // tags_cap. When decrypting, tree has the leaves to check them against.
+   unsigned char *tags;
+   uint_fast64_t tags_cap;
+   const unsigned char *tree;
+
+   // For --patch: the chunks to seal again, in order, followed by how many
+   // the output has. Indices are into this rather than of chunks.
+   uint_fast64_t *patch;
+
+   // For --store: the directory, and the names of the chunks in it, keyed
+   // hashes of their plaintext. When encrypting, those of the chunks written
+   // so far, with room for ids_cap, of which stored were new; otherwise the
+   // manifest's nids.
+   const char *store;
+   unsigned char id_key[crypto_generichash_KEYBYTES];
+   unsigned char *ids;
+   uint_fast64_t ids_cap, nids, stored;
+
+   // If not NULL, chunks go to or come from volumes rather than stdout or
+   // in_fd. When decrypting, in_base and in_end are of the volumes as one.
+   struct volumes *volumes;
+
+   // For --shared-cache: where chunks that opened are put, and looked up
+   // before opening any.
+   struct shared *shared;
+
+   // For --connect, when stdout is a socket taking MSG_ZEROCOPY: the kernel
+   // reads chunks from their buffers after they're sent, so they're only
+   // freed once it says it's done. zc_sent counts the sends, zc_done those
+   // it's done with from the first on, and zc_acked marks which of the
+   // others it is, by their numbers modulo ZEROCOPY_WINDOW. zc_copied of
+   // them it copied after all.
+   uint_fast64_t zc_sent, zc_done, zc_copied;
+   unsigned char *zc_acked;
+
+   // For --follow: the input's name, and when to hand out a chunk before it's
+   // full.
+   const char *follow;
+   size_t flush_size;
+   uint_fast64_t flush_after;
+
+   // For --checkpoint, which also needs the header's hash.
+   const char *checkpoint;
+   uint_fast64_t checkpoint_every;
+   unsigned char header_hash[crypto_generichash_BYTES];
+
+   off_t out_base;
+
+   // For --read-rate and --write-rate.
+   struct throttle read_throttle, write_throttle;
+
+   // With --numa, worker and reader i run on nodes[i % nnodes], preferring
+   // the chunks whose buffers are there.
+   struct node *nodes;
+   size_t nnodes, workers_started, readers_started, stream_batch;
+
+   // The nonce schedule, which only one reader touches at a time. No chunks
+   // from end_idx on are read.
+   FILE *urandom;
+   unsigned char nonce[crypto_secretbox_NONCEBYTES];
+   uint_fast64_t next_idx, end_idx, total_read;
+   int_fast32_t new_nonce_in;
+
+   // For --append: plaintext to put before the input.
+   unsigned char *carry;
+   size_t carry_len;
+
+   // For --follow: an inotify watching the input, if it's a regular file
+   // and inotify works. When decrypting, growing is set if the input is a
+   // regular file, and follow_size is negative if not given.
+   off_t follow_size;
+   uint_fast64_t follow_timeout;
+
+   // For positional reads: chunk 0 starts at in_base, the input ends at
+   // in_end, and dispatched is set once all chunks have been handed out.
+   off_t in_base, in_end;
+
+   // The smaller fields, together so as not to leave holes between the
+   // others: notify and growing are --follow's, and in_fd, dispatched and
+   // read_status the positional reads'. trailer_read is whether the trailer
+   // of a framed input has been read, finished whether --tee destinations
+   // have all they'll get, and records is for --records.
+   int status, notify, in_fd, read_status;
+   enum { RECORDS_NONE, RECORDS_LINES, RECORDS_LENGTHS } records;
+   bool finished, writing, eof, trailer_read, growing, dispatched;
+   bool decrypting, chunk_nonces, framed, verbose, drop_cache;
+   bool deterministic, merkle, zerocopy;
+
+   // Up to the digests' alignment.
+   char pad[38];
+};
+
+static void __attribute__ ((cold)) fail(struct engine *e, int status) {
+   if (!e->status)
+      e->status = status;
+   pthread_cond_broadcast(&e->cond);
+}
+
+// Whether the output is plaintext: decrypting, but not for --transcode.
+static bool plain_out(const struct engine *e) {
+   return e->decrypting && !e->reseal_key;
+}
+
+// Which chunk of infile and the output idx is.
+static uint_fast64_t chunk_at(const struct engine *e, uint_fast64_t idx) {
+   return e->patch ? e->patch[idx] : idx;
+}
+
+// The file off of the input is in: in_fd or, for --volumes, the volume
+// holding it, off then being moved to where it is there. Reads starting at off
+// mustn't go past the chunk it's in.
+static int in_at(const struct engine *e, off_t *off) {
+   const struct volumes *v = e->volumes;
+   if (!v || !plain_out(e))
+      return e->in_fd;
+   const uint_fast64_t idx = (uint_fast64_t)*off / BUFLEN,
+                       i = idx / v->per_volume;
+   *off = (off_t)((idx % v->per_volume) * BUFLEN) + *off % (off_t)BUFLEN
+        + (i ? 0 : v->base);
+   return v->fds[i];
+}
+
+// For --volume-size: the file output chunk idx goes in, and where in it,
+// opening any volumes up to it not opened yet. Returns -1 if one can't be.
+static int out_at(struct engine *e, uint_fast64_t idx, off_t *off) {
+   struct volumes *v = e->volumes;
+   const size_t i = (size_t)(idx / v->per_volume);
+   *off = (off_t)((idx % v->per_volume) * BUFLEN) + (i ? 0 : v->base);
+
+   pthread_mutex_lock(&e->lock);
+   while (v->n <= i) {
+      if (v->n == v->cap) {
+         const size_t want = v->cap ? v->cap * 2 : 16;
+         int *grown = realloc(v->fds, want * sizeof *grown);
+         if (!grown) {
+            perror("Couldn't malloc volumes");
+            break;
+         }
+         v->fds = grown;
+         v->cap = want;
+      }
+      char path[PATH_MAX];
+      volume_path(path, v, v->n);
+      const int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                          0666);
+      if (fd < 0) {
+         fprintf(stderr, "Couldn't open %s: %s\n", path, strerror(errno));
+         break;
+      }
+      v->fds[v->n++] = fd;
+   }
+   const int fd = i < v->n ? v->fds[i] : -1;
+   pthread_mutex_unlock(&e->lock);
+   return fd;
+}
+
+// Like read_full from f, or pread_full from in_fd at off if f is NULL, but
+// keeping to --read-rate.
+static size_t read_chunk(struct engine *e, FILE *f, unsigned char *buf,
+                         size_t n, off_t off)
+{
+   const int fd = f ? -1 : in_at(e, &off);
+   struct throttle *t = &e->read_throttle;
+   if (!t->rate)
+      return f ? read_full(f, buf, n) : pread_full(fd, buf, n, off);
+
+   size_t r = 0;
+   while (r < n) {
+      const size_t want = n - r < THROTTLE_PIECE ? n - r : THROTTLE_PIECE;
+      throttle(t, want);
+      const size_t x = f ? read_full(f, buf + r, want)
+                         : pread_full(fd, buf + r, want, off + (off_t)r);
+      r += x;
+      if (x < want)
+         break;
+   }
+   return r;
+}
+
+// Like write_full to stdout, or pwrite_full to fd at off if off isn't
+// negative, but keeping to --write-rate.
+static size_t write_chunk(struct engine *e, int fd, unsigned char *buf,
+                          size_t n, off_t off)
+{
+   struct throttle *t = &e->write_throttle;
+   if (!t->rate) {
+      return off < 0 ? write_full(stdout, buf, n)
+                     : pwrite_full(fd, buf, n, off);
+   }
+
+   size_t w = 0;
+   while (w < n) {
+      const size_t want = n - w < THROTTLE_PIECE ? n - w : THROTTLE_PIECE;
+      throttle(t, want);
+      const size_t x =
+         off < 0 ? write_full(stdout, buf + w, want)
+                 : pwrite_full(fd, buf + w, want, off + (off_t)w);
+      w += x;
+      if (x < want)
+         break;
+   }
+   return w;
+}
+
+// Called with the lock held. Unlinks the first chunk in list on the given
+// node or, failing that, the first one at all.
+static struct chunk *take(struct chunk **list, struct chunk ***tail,
+                          size_t node)
+{
+   struct chunk **p = list;
+   while (*p && (*p)->node != node)
+      p = &(*p)->next;
+   if (!*p)
+      p = list;
+
+   struct chunk *c = *p;
+   if (c && !(*p = c->next) && tail)
+      *tail = p;
+   return c;
+}
+
+// Called with the lock held, returns the node the caller should run on: the
+// next one that hasn't had its share of threads of the given kind.
+static size_t place(struct engine *e, size_t *started) {
+   const size_t i = (*started)++;
+   if (!e->nnodes)
+      return 0;
+
+   const size_t node = i % e->nnodes;
+   pthread_setaffinity_np(pthread_self(), sizeof e->nodes[node].cpus,
+                          &e->nodes[node].cpus);
+   return node;
+}
+
+static void put_hex(FILE *f, const char *name, const unsigned char *buf,
+                    size_t n)
+{
+   fprintf(f, "%s ", name);
+   for (size_t i = 0; i < n; ++i)
+      fprintf(f, "%02x", buf[i]);
+   fputc('\n', f);
+}
+
+// For --show-tree: the nodes depth levels below the root (or the leaves, if
+// there aren't that many), with the chunks under each, so that copies can be
+// compared a subtree at a time.
+static void print_tree(FILE *f, const unsigned char *tree, uint_fast64_t n,
+                       unsigned long long depth)
+{
+   if (!n) {
+      unsigned char root[DIGESTLEN];
+      merkle_build(NULL, 0, root);
+      put_hex(f, "tree 0.0 chunks 0:0", root, sizeof root);
+      return;
+   }
+
+   unsigned levels = 0;
+   for (uint_fast64_t k = n; k; k = k > 1 ? (k + 1) / 2 : 0)
+      ++levels;
+   if (depth >= levels)
+      depth = levels - 1;
+
+   const unsigned up = levels - 1 - (unsigned)depth;
+   uint_fast64_t k = n;
+   for (unsigned i = 0; i < up; ++i) {
+      tree += k * DIGESTLEN;
+      k = (k + 1) / 2;
+   }
+   for (uint_fast64_t j = 0; j < k; ++j) {
+      const uint_fast64_t end = (j + 1) << up;
+      char name[96];
+      snprintf(name, sizeof name,
+               "tree %llu.%" PRIuFAST64 " chunks %" PRIuFAST64 ":%" PRIuFAST64,
+               depth, j, j << up, end < n ? end : n);
+      put_hex(f, name, tree + j * DIGESTLEN, DIGESTLEN);
+   }
+}
+
+static bool get_hex(FILE *f, const char *name, unsigned char *buf, size_t n) {
+   char word[32];
+   if (fscanf(f, "%31s", word) != 1 || strcmp(word, name))
+      return false;
+   for (size_t i = 0; i < n; ++i) {
+      if (fscanf(f, "%2hhx", &buf[i]) != 1)
+         return false;
+   }
+   return true;
+}
+
+// Records that all chunks before idx are in the output for good, the last of
+// them having been sealed with nonce. The checkpoint is replaced by renaming,
+// so it's always either the old one or the new one.
+static bool save_checkpoint(const struct engine *e, uint_fast64_t idx,
+                            const unsigned char *nonce)
+{
+   if (fdatasync(STDOUT_FILENO)) {
+      perror("Couldn't sync stdout");
+      return false;
+   }
+
+   char tmp[4096];
+   if ((size_t)snprintf(tmp, sizeof tmp, "%s.tmp", e->checkpoint)
+       >= sizeof tmp)
+   {
+      fputs("Checkpoint file name too long\n", stderr);
+      return false;
+   }
+   FILE *f = fopen(tmp, "w");
+   if (!f) {
+      perror("Couldn't write checkpoint");
+      return false;
+   }
+   fputs("naclypt checkpoint\n", f);
+   put_hex(f, "header", e->header_hash, sizeof e->header_hash);
+   put_hex(f, "nonce", nonce, crypto_secretbox_NONCEBYTES);
+   fprintf(f, "chunks %" PRIuFAST64 "\n", idx);
+   if (fflush(f) || fsync(fileno(f)) | fclose(f) || rename(tmp, e->checkpoint))
+   {
+      perror("Couldn't write checkpoint");
+      return false;
+   }
+   return true;
+}
+
+static bool load_checkpoint(const char *path, unsigned char *header_hash,
+                            unsigned char *nonce, uint_fast64_t *idx)
+{
+   FILE *f = fopen(path, "r");
+   if (!f) {
+      perror("Couldn't open checkpoint");
+      return false;
+   }
+   char line[32];
+   const bool ok =
+      fgets(line, sizeof line, f) && !strcmp(line, "naclypt checkpoint\n")
+   && get_hex(f, "header", header_hash, crypto_generichash_BYTES)
+   && get_hex(f, "nonce", nonce, crypto_secretbox_NONCEBYTES)
+   && fscanf(f, " chunks %" SCNuFAST64, idx) == 1;
+   fclose(f);
+   if (!ok)
+      fprintf(stderr, "Invalid checkpoint %s\n", path);
+   return ok;
+}
+
+// Writes n octets of output to stdout in order. When encrypting into frames,
+// they're a box, which is preceded by its length.
+static bool write_box(struct engine *e, unsigned char *buf, size_t n) {
+   unsigned char frame[4] = {
+      (uint8_t)(n >> 24), (uint8_t)(n >> 16), (uint8_t)(n >> 8), (uint8_t)n,
+   };
+   const bool framing = e->framed && !e->decrypting;
+
+   // A framed stream is likely being waited on, so don't sit on it.
+   return (!framing || write_full(stdout, frame, sizeof frame) == sizeof frame)
+       && write_chunk(e, -1, buf, n, -1) == n
+       && (!e->framed || !fflush(stdout));
+}
+
+// For --connect: takes the sends the kernel is done with off the socket's
+// error queue, first waiting until there are some if wait is set. Called with
+// the lock held, which is let go of while waiting. Returns false if the socket
+// was closed before the sends waited for were done.
+static bool reap_sends(struct engine *e, bool wait) {
+   const uint_fast64_t before = e->zc_done;
+   struct pollfd p = {.fd = STDOUT_FILENO};
+   if (wait) {
+      pthread_mutex_unlock(&e->lock);
+      (void) poll(&p, 1, -1);
+      pthread_mutex_lock(&e->lock);
+   }
+   for (;;) {
+      union {
+         char buf[CMSG_SPACE(sizeof(struct sock_extended_err)
+                             + sizeof(struct sockaddr_in6))];
+         struct cmsghdr align;
+      } u;
+      struct msghdr msg = {
+         .msg_control = u.buf,
+         .msg_controllen = sizeof u.buf,
+      };
+      if (recvmsg(STDOUT_FILENO, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+         break;
+      for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+           cmsg = CMSG_NXTHDR(&msg, cmsg))
+      {
+         struct sock_extended_err ee;
+         if (!(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR)
+          && !(cmsg->cmsg_level == SOL_IPV6
+            && cmsg->cmsg_type == IPV6_RECVERR))
+            continue;
+         memcpy(&ee, CMSG_DATA(cmsg), sizeof ee);
+         if (ee.ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+            continue;
+         for (uint32_t id = ee.ee_info;; ++id) {
+            e->zc_acked[id % ZEROCOPY_WINDOW] = 1;
+            if (id == ee.ee_data)
+               break;
+         }
+         if (ee.ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+            e->zc_copied += ee.ee_data - ee.ee_info + 1;
+      }
+   }
+   while (e->zc_acked[e->zc_done % ZEROCOPY_WINDOW]) {
+      e->zc_acked[e->zc_done % ZEROCOPY_WINDOW] = 0;
+      ++e->zc_done;
+   }
+   return !wait || !(p.revents & (POLLHUP | POLLNVAL)) || e->zc_done != before;
+}
+
+// For --connect: like write_box, but sending the box with MSG_ZEROCOPY, so
+// that buf can't be reused until zc_done reaches what's left in end. Only
+// one thread does this at a time.
+static bool send_box(struct engine *e, const unsigned char *buf, size_t n,
+                     uint_fast64_t *end)
+{
+   unsigned char frame[4] = {
+      (uint8_t)(n >> 24), (uint8_t)(n >> 16), (uint8_t)(n >> 8), (uint8_t)n,
+   };
+   const bool framing = e->framed && !e->decrypting;
+   if ((framing && write_full(stdout, frame, sizeof frame) != sizeof frame)
+    || fflush(stdout))
+      return false;
+
+   struct throttle *t = &e->write_throttle;
+   for (size_t w = 0, throttled = 0; w < n;) {
+      const size_t want = !t->rate || n - w < THROTTLE_PIECE
+                        ? n - w : THROTTLE_PIECE;
+      if (t->rate && throttled <= w) {
+         throttle(t, want);
+         throttled = w + 1;
+      }
+
+      // Too much may be pinned already. If none of it is ours, send a copy.
+      int flags = MSG_NOSIGNAL | MSG_ZEROCOPY;
+      ssize_t x = send(STDOUT_FILENO, buf + w, want, flags);
+      if (x < 0 && errno == ENOBUFS) {
+         if (e->zc_done == e->zc_sent) {
+            flags = MSG_NOSIGNAL;
+            x = send(STDOUT_FILENO, buf + w, want, flags);
+         } else {
+            pthread_mutex_lock(&e->lock);
+            const bool ok = reap_sends(e, true);
+            pthread_mutex_unlock(&e->lock);
+            if (!ok)
+               return false;
+            continue;
+         }
+      }
+      if (x < 0 && errno == EINTR)
+         continue;
+      if (x < 0)
+         return false;
+      w += (size_t)x;
+      if (flags & MSG_ZEROCOPY)
+         *end = ++e->zc_sent;
+   }
+   return true;
+}
+
+// Like write_box, to a --tee destination.
+static bool tee_box(const struct engine *e, const struct tee *t,
+                    const unsigned char *buf, size_t n)
+{
+   const unsigned char frame[4] = {
+      (uint8_t)(n >> 24), (uint8_t)(n >> 16), (uint8_t)(n >> 8), (uint8_t)n,
+   };
+   const bool framing = e->framed && !e->decrypting;
+   if (write_fd_full(t->fd, framing ? frame : buf, framing ? 4 : n)
+       == (framing ? 4 : n)
+    && (!framing || write_fd_full(t->fd, buf, n) == n))
+      return true;
+
+   fprintf(stderr, "Couldn't write to %s: %s\n", t->name, strerror(errno));
+   return false;
+}
+
+// Called with the lock held. Frees the chunks that stdout and every --tee
+// destination are done with.
+static void release(struct engine *e) {
+   uint_fast64_t upto = e->written;
+   for (size_t i = 0; i < e->ntees; ++i) {
+      if (e->tees[i].next < upto)
+         upto = e->tees[i].next;
+   }
+   for (; e->released < upto; ++e->released) {
+      struct chunk **slot = &e->done[e->released % e->nchunks];
+      if (e->zerocopy && (*slot)->zc_end > e->zc_done)
+         break;
+      (*slot)->next = e->free;
+      e->free = *slot;
+      *slot = NULL;
+   }
+   pthread_cond_broadcast(&e->cond);
+}
+
+// Writes the chunks, in order, to a --tee destination as they're done.
+static void *write_tee(void *arg) {
+   struct tee *t = arg;
+   struct engine *e = t->e;
+   const size_t ooffset = plain_out(e) ? crypto_secretbox_ZEROBYTES : 0;
+
+   pthread_mutex_lock(&e->lock);
+   for (;;) {
+      struct chunk *c;
+      while (!e->status
+          && !((c = e->done[t->next % e->nchunks]) && c->idx == t->next)
+          && !(e->finished && t->next >= e->next_idx))
+         pthread_cond_wait(&e->cond, &e->lock);
+      if (e->status || t->next >= e->next_idx)
+         break;
+      pthread_mutex_unlock(&e->lock);
+
+      const bool ok = tee_box(e, t, c->obuf + ooffset, c->len - ooffset);
+
+      pthread_mutex_lock(&e->lock);
+      if (UNLIKELY(!ok)) {
+         fail(e, 1);
+         break;
+      }
+      ++t->next;
+      release(e);
+   }
+   pthread_mutex_unlock(&e->lock);
+   return NULL;
+}
+
+// Called with the lock held. Puts item, the size octets kept for chunk idx,
+// into *buf, growing it as needed.
+static bool keep(unsigned char **buf, uint_fast64_t *cap, uint_fast64_t idx,
+                 const unsigned char *item, size_t size)
+{
+   if (idx == *cap) {
+      const uint_fast64_t want = *cap ? *cap * 2 : 1024;
+      unsigned char *grown = realloc(*buf, want * size);
+      if (!grown) {
+         perror("Couldn't malloc");
+         return false;
+      }
+      *buf = grown;
+      *cap = want;
+   }
+   memcpy(*buf + idx * size, item, size);
+   return true;
+}
+
+// Hashes the plaintext and ciphertext of c, as they are in the input or
+// output, into its leaves of the digest trees.
+static void hash_chunk(const struct engine *e, struct chunk *c) {
+   const size_t z = crypto_secretbox_ZEROBYTES;
+   if (e->plain_digest.alg) {
+      digest_leaf(&e->plain_digest, c->plain_leaf,
+                  (plain_out(e) ? c->obuf : c->ibuf) + z, c->len - z);
+   }
+   if (e->cipher_digest.alg) {
+      // When decrypting, the random part of a new nonce was zeroed out
+      // before opening.
+      if (plain_out(e) && UNLIKELY(c->new_nonce))
+         memcpy(c->ibuf, c->nonce, NONCE_RANDOMS);
+      digest_leaf(&e->cipher_digest, c->cipher_leaf,
+                  plain_out(e) ? c->ibuf : c->obuf, c->len);
+   }
+}
+
+// For --deterministic: the random part of c's nonce is instead a keyed hash
+// of where it is and its plaintext, so that sealing the same chunk in the same
+// place again gives the same box.
+static void derive_nonce(const struct engine *e, struct chunk *c) {
+   crypto_generichash_state s;
+   crypto_generichash_init(&s, e->nonce_key, sizeof e->nonce_key,
+                           NONCE_RANDOMS);
+   crypto_generichash_update(&s, c->nonce + crypto_secretbox_BOXZEROBYTES,
+                             crypto_secretbox_NONCEBYTES
+                           - crypto_secretbox_BOXZEROBYTES);
+   crypto_generichash_update(&s, c->ibuf + crypto_secretbox_ZEROBYTES,
+                             c->len - crypto_secretbox_ZEROBYTES);
+   crypto_generichash_final(&s, c->nonce, NONCE_RANDOMS);
+
+   // All zeroes would continue the previous chunk's nonce instead.
+   if (UNLIKELY(is_zero(c->nonce, NONCE_RANDOMS)))
+      c->nonce[0] = 1;
+}
+
+// For --store: where the chunk named id goes, in a subdirectory named after
+// its first octet so that none gets too big.
+static void store_path(char *path, const char *dir, const unsigned char *id) {
+   int len = snprintf(path, PATH_MAX, "%s/%02x/", dir, id[0]);
+   for (size_t i = 0; i < DIGESTLEN && len > 0 && len < PATH_MAX; ++i)
+      len += snprintf(path + len, PATH_MAX - (size_t)len, "%02x", id[i]);
+}
+
+// For --store: names c after a keyed hash of its plaintext and, unless the
+// store already has a chunk by that name, seals it and writes it there. Its
+// nonce is derived as with --deterministic but regardless of place, so that
+// the same plaintext anywhere gives the same box. Returns the exit status.
+static int store_chunk(const struct engine *e, struct chunk *c) {
+   const size_t z = crypto_secretbox_ZEROBYTES;
+   char path[PATH_MAX], tmp[PATH_MAX];
+   crypto_generichash(c->id, DIGESTLEN, c->ibuf + z, c->len - z, e->id_key,
+                      sizeof e->id_key);
+   store_path(path, e->store, c->id);
+   if (!(c->stored = access(path, F_OK) != 0))
+      return 0;
+
+   memset(c->nonce + NONCE_RANDOMS, 0, sizeof c->nonce - NONCE_RANDOMS);
+   derive_nonce(e, c);
+   crypto_secretbox(c->obuf, c->ibuf, c->len, c->nonce, e->key);
+   memcpy(c->obuf, c->nonce, NONCE_RANDOMS);
+
+   // Synced under a temporary name first, so that a chunk that's there by
+   // its name is whole.
+   const int dirlen = (int)(strrchr(path, '/') - path);
+   snprintf(tmp, sizeof tmp, "%.*s", dirlen, path);
+   if (mkdir(tmp, 0777) && errno != EEXIST) {
+      fprintf(stderr, "Couldn't create %s: %s\n", tmp, strerror(errno));
+      return 1;
+   }
+   snprintf(tmp, sizeof tmp, "%.*s/.XXXXXX", dirlen, path);
+   const int fd = mkstemp(tmp);
+   bool ok = fd >= 0 && write_fd_full(fd, c->obuf, c->len) == c->len
+          && !fdatasync(fd);
+   if (fd >= 0 && close(fd))
+      ok = false;
+   if (!ok || rename(tmp, path)) {
+      fprintf(stderr, "Couldn't write %s: %s\n", path, strerror(errno));
+      if (fd >= 0)
+         unlink(tmp);
+      return 1;
+   }
+   return 0;
+}
+
+// For --transcode: seals the opened c again under reseal_key, into ibuf, and
+// swaps the buffers so that it's as if c had been read as plaintext and
+// sealed.
+static void reseal(const struct engine *e, struct chunk *c) {
+   unsigned char *plain = c->obuf;
+   crypto_secretbox(c->ibuf, plain, c->len, c->reseal_nonce, e->reseal_key);
+   if (UNLIKELY(c->reseal_new_nonce))
+      memcpy(c->ibuf, c->reseal_nonce, NONCE_RANDOMS);
+   c->obuf = c->ibuf;
+   c->ibuf = plain;
+}
+
+// Called with the lock held.
+static void retire(struct engine *e) {
+   if (e->writing)
+      return;
+   e->writing = true;
+
+   const size_t ooffset = plain_out(e) ? crypto_secretbox_ZEROBYTES : 0;
+   struct chunk *c;
+   while (!e->status
+       && (c = e->done[e->written % e->nchunks]) && c->idx == e->written)
+   {
+      const size_t n = c->len - ooffset;
+
+      // Chunks going into a store are only named in the manifest.
+      c->zc_end = 0;
+      if (e->out_base < 0 && !(e->store && !e->decrypting)) {
+         pthread_mutex_unlock(&e->lock);
+         const bool ok = e->zerocopy
+                       ? send_box(e, c->obuf + ooffset, n, &c->zc_end)
+                       : write_box(e, c->obuf + ooffset, n);
+         pthread_mutex_lock(&e->lock);
+         if (UNLIKELY(!ok)) {
+            fputs("Couldn't write ciphertext to stdout\n", stderr);
+            fail(e, 1);
+         }
+         if (e->zerocopy)
+            (void) reap_sends(e, false);
+      }
+
+      ++e->written;
+      e->out_len += n;
+      digest_add(&e->plain_digest, c->plain_leaf);
+      digest_add(&e->cipher_digest, c->cipher_leaf);
+
+      if (UNLIKELY(e->merkle
+                && !keep(&e->tags, &e->tags_cap, c->idx,
+                         c->obuf + crypto_secretbox_BOXZEROBYTES,
+                         crypto_secretbox_MACBYTES)))
+      {
+         fail(e, 4);
+         break;
+      }
+      if (e->store && !e->decrypting) {
+         if (UNLIKELY(!keep(&e->ids, &e->ids_cap, c->idx, c->id, DIGESTLEN))) {
+            fail(e, 4);
+            break;
+         }
+         e->stored += c->stored;
+      }
+
+      // Only full chunks, so that a resumed run can pick up right after.
+      if (e->checkpoint && c->len == BUFLEN
+       && !((e->written - e->first_idx) % e->checkpoint_every))
+      {
+         const uint_fast64_t idx = e->written;
+         unsigned char nonce[crypto_secretbox_NONCEBYTES];
+         memcpy(nonce, c->nonce, sizeof nonce);
+         pthread_mutex_unlock(&e->lock);
+         const bool ok = save_checkpoint(e, idx, nonce);
+         pthread_mutex_lock(&e->lock);
+         if (UNLIKELY(!ok))
+            fail(e, 1);
+      }
+      release(e);
+
+      // Leave no more than half the chunks to the kernel, so that the rest
+      // can keep going. This is where a slow receiver holds us back.
+      const size_t held = e->nchunks / 2;
+      while (e->zerocopy && !e->status && e->written - e->released > held
+          && e->done[(e->written - held - 1) % e->nchunks]->zc_end
+             > e->zc_done)
+      {
+         if (!reap_sends(e, true)) {
+            fputs("Couldn't write ciphertext to stdout\n", stderr);
+            fail(e, 1);
+         }
+         release(e);
+      }
+   }
+   e->writing = false;
+}
+
+// Where chunk idx goes when pwriting.
+static off_t out_offset(const struct engine *e, uint_fast64_t idx) {
+   const size_t ostride = plain_out(e) ? CHUNKLEN : BUFLEN;
+   return e->out_base + (off_t)((chunk_at(e, idx) - e->first_idx) * ostride);
+}
+
+// For --drop-cache: start writing chunk idx back right away, then wait until
+// the one nchunks before it (most likely done by now) has been written back
+// and drop it from the page cache. This keeps dirty pages from piling up only
+// to stall everything once the kernel decides to write them back.
+static void drop_behind(const struct engine *e, uint_fast64_t idx) {
+   const off_t ostride = plain_out(e) ? CHUNKLEN : BUFLEN;
+   (void) sync_file_range(STDOUT_FILENO, out_offset(e, idx), ostride,
+                          SYNC_FILE_RANGE_WRITE);
+   if (idx - e->first_idx < e->nchunks)
+      return;
+
+   const off_t off = out_offset(e, idx - e->nchunks);
+   (void) sync_file_range(STDOUT_FILENO, off, ostride,
+                          SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE
+                        | SYNC_FILE_RANGE_WAIT_AFTER);
+   (void) posix_fadvise(STDOUT_FILENO, off, ostride, POSIX_FADV_DONTNEED);
+}
+
+static void *work(void *arg) {
+   struct engine *e = arg;
+   const size_t ooffset = plain_out(e) ? crypto_secretbox_ZEROBYTES : 0;
+
+   pthread_mutex_lock(&e->lock);
+   const size_t node = place(e, &e->workers_started);
+   for (;;) {
+      while (!e->queue && !e->eof && !e->status)
+         pthread_cond_wait(&e->cond, &e->lock);
+      if (e->status)
+         break;
+      struct chunk *c = take(&e->queue, &e->queue_tail, node);
+      if (!c)
+         break;
+      pthread_mutex_unlock(&e->lock);
+
+      int status = 0;
+      if (e->decrypting) {
+         // Output of a box that doesn't open is left at zero, but a trailer
+         // has no output: it's there to show that nothing was cut off. A
+         // growing input might not have been written in order, so zeroes
+         // read ahead of the data mustn't pass either. Nor may anything
+         // but what the tree of a --merkle input, already checked, or a
+         // --store manifest has, nor anything to --transcode.
+         unsigned char leaf[DIGESTLEN], id[DIGESTLEN];
+         bool cached = false, opened;
+         if (e->shared && !c->trailer) {
+            shared_id(e->key, c->nonce, c->ibuf, id);
+            cached = shared_get(e->shared, id,
+                                c->obuf + crypto_secretbox_ZEROBYTES,
+                                c->len - crypto_secretbox_ZEROBYTES);
+            if (cached)
+               memset(c->obuf, 0, crypto_secretbox_ZEROBYTES);
+         }
+         opened = cached || !crypto_secretbox_open(c->obuf, c->ibuf, c->len,
+                                                   c->nonce, e->key);
+         if (!opened)
+            memset(c->obuf, 0, c->len);  // Not some earlier chunk's output.
+         if (!opened && UNLIKELY(c->trailer || e->growing || e->tree
+                              || e->store || e->reseal_key))
+         {
+            fprintf(stderr, "Invalid input: chunk %" PRIuFAST64 " doesn't "
+                            "open\n", c->idx);
+            status = 11;
+         } else if (e->tree) {
+            merkle_hash(leaf, 0, c->ibuf + crypto_secretbox_BOXZEROBYTES,
+                        crypto_secretbox_MACBYTES);
+            if (memcmp(leaf, e->tree + c->idx * DIGESTLEN, DIGESTLEN)) {
+               fprintf(stderr, "Invalid input: chunk %" PRIuFAST64 " isn't "
+                               "the one in the tree\n", c->idx);
+               status = 11;
+            }
+         } else if (e->store) {
+            crypto_generichash(leaf, DIGESTLEN,
+                               c->obuf + crypto_secretbox_ZEROBYTES,
+                               c->len - crypto_secretbox_ZEROBYTES,
+                               e->id_key, sizeof e->id_key);
+            if (memcmp(leaf, e->ids + c->idx * DIGESTLEN, DIGESTLEN)) {
+               fprintf(stderr, "Invalid store: chunk %" PRIuFAST64 " isn't "
+                               "the one in the manifest\n", c->idx);
+               status = 11;
+            }
+         }
+         if (e->shared && opened && !cached && !c->trailer && !status) {
+            shared_put(e->shared, id, c->obuf + crypto_secretbox_ZEROBYTES,
+                       c->len - crypto_secretbox_ZEROBYTES);
+         }
+      } else if (e->store) {
+         status = store_chunk(e, c);
+      } else {
+         if (e->deterministic)
+            derive_nonce(e, c);
+         crypto_secretbox(c->obuf, c->ibuf, c->len, c->nonce, e->key);
+         if (UNLIKELY(c->new_nonce))
+            memcpy(c->obuf, c->nonce, NONCE_RANDOMS);
+      }
+      if (e->reseal_key && !status)
+         reseal(e, c);
+      hash_chunk(e, c);
+
+      if (!status && e->out_base >= 0) {
+         const size_t n = c->len - ooffset;
+         off_t off = out_offset(e, c->idx);
+         const int fd = e->volumes && !plain_out(e)
+                      ? out_at(e, c->idx, &off) : STDOUT_FILENO;
+         if (UNLIKELY(fd < 0)) {
+            status = 1;
+         } else if (UNLIKELY(write_chunk(e, fd, c->obuf + ooffset, n, off)
+                             != n))
+         {
+            perror("Couldn't write ciphertext to stdout");
+            status = 1;
+         } else if (e->drop_cache) {
+            drop_behind(e, c->idx);
+         }
+      }
+
+      pthread_mutex_lock(&e->lock);
+      if (UNLIKELY(status)) {
+         fail(e, status);
+         break;
+      }
+      e->done[c->idx % e->nchunks] = c;
+      if (e->ntees)
+         pthread_cond_broadcast(&e->cond);
+      retire(e);
+   }
+   pthread_mutex_unlock(&e->lock);
+   return NULL;
+}
+
+// Called with the lock held.
+static void enqueue(struct engine *e, struct chunk *c) {
+   c->next = NULL;
+   *e->queue_tail = c;
+   e->queue_tail = &c->next;
+   pthread_cond_signal(&e->cond);
+}
+
+static struct chunk *get_free(struct engine *e) {
+   pthread_mutex_lock(&e->lock);
+   while (!e->free && !e->status)
+      pthread_cond_wait(&e->cond, &e->lock);
+
+   struct chunk *c = NULL;
+   if (!e->status) {
+      const size_t batch = e->stream_batch++ / NUMA_BATCH;
+      c = take(&e->free, NULL, e->nnodes ? batch % e->nnodes : 0);
+   }
+   pthread_mutex_unlock(&e->lock);
+   return c;
+}
+
+// Called with the lock held, if there are several readers. Gives c the next
+// index and its nonce, given that it's r octets long. When decrypting, the
+// random part of a new nonce is taken from prefix, the chunk's first
+// NONCE_RANDOMS octets. With --deterministic, every chunk starts a new one,
+// which work derives once the chunk has been read.
+static bool plan_chunk(struct engine *e, struct chunk *c, size_t r,
+                       const unsigned char *prefix)
+{
+   // With --patch, each chunk starts a new nonce for where it is.
+   if (e->patch) {
+      e->total_read = e->patch[e->next_idx] * CHUNKLEN;
+      e->new_nonce_in = 0;
+   }
+
+   const bool need_new_nonce = e->decrypting && e->chunk_nonces
+                             ? !is_zero(prefix, NONCE_RANDOMS)
+                             : e->deterministic || e->new_nonce_in <= 0;
+
+   if (UNLIKELY(need_new_nonce)) {
+      if (e->decrypting) {
+         memcpy(e->nonce, prefix, NONCE_RANDOMS);
+      } else if (!e->deterministic
+              && UNLIKELY(read_full(e->urandom, e->nonce, NONCE_RANDOMS)
+                          != NONCE_RANDOMS))
+      {
+         fputs("/dev/urandom failed to provide\n", stderr);
+         return false;
+      }
+   }
+   if (need_new_nonce || e->chunk_nonces)
+      fill_in_nonce(e->nonce, e->total_read);
+
+   const size_t n = e->decrypting ? r - crypto_secretbox_ZEROBYTES : r;
+
+   // For --transcode: the nonce to seal the chunk again under. It's at the
+   // same offset in the output, so the schedule is that of encrypting.
+   if (e->reseal_key) {
+      c->reseal_new_nonce = e->reseal_in <= 0;
+      if (UNLIKELY(c->reseal_new_nonce)
+       && UNLIKELY(read_full(e->urandom, e->reseal_nonce, NONCE_RANDOMS)
+                   != NONCE_RANDOMS))
+      {
+         fputs("/dev/urandom failed to provide\n", stderr);
+         return false;
+      }
+      fill_in_nonce(e->reseal_nonce, e->total_read);
+      e->reseal_in = c->reseal_new_nonce ? INT32_MAX
+                                         : e->reseal_in - (int_fast32_t)n;
+      memcpy(c->reseal_nonce, e->reseal_nonce, sizeof c->reseal_nonce);
+   }
+   e->total_read += n;
+
+   // Arbitrary value but must be greater than BUFLEN.
+   e->new_nonce_in = need_new_nonce ? INT32_MAX
+                                    : e->new_nonce_in - (int_fast32_t)n;
+
+   c->idx = e->next_idx++;
+   c->len = e->decrypting ? r : r + crypto_secretbox_ZEROBYTES;
+   c->new_nonce = need_new_nonce;
+   c->trailer = n == 0;
+   memcpy(c->nonce, e->nonce, sizeof c->nonce);
+   return true;
+}
+
+// When decrypting, the random part of a new nonce is replaced with the zeroes
+// that crypto_secretbox_open expects, and otherwise they must be there.
+static bool check_zeroes(struct chunk *c) {
+   if (UNLIKELY(c->new_nonce)) {
+      memset(c->ibuf, 0, NONCE_RANDOMS);
+      return true;
+   }
+   for (size_t i = 0; i < crypto_secretbox_BOXZEROBYTES; ++i) {
+      if (LIKELY(!c->ibuf[i]))
+         continue;
+      fprintf(stderr, "Invalid input: octet %#" PRIxFAST64 " should "
+                      "have been zero, not %#x\n",
+                      c->idx * CHUNKLEN + i, c->ibuf[i]);
+      return false;
+   }
+   return true;
+}
+
+static int __attribute__ ((cold)) truncated(uint_fast64_t total_read, size_t r)
+{
+   fprintf(stderr, "Invalid input: expected at least %u octets after %#zx, "
+                   "got only %zu\n",
+                   crypto_secretbox_ZEROBYTES, total_read, r);
+   return 11;
+}
+
+static volatile sig_atomic_t stopping;
+
+static void stop(int sig) {
+   (void) sig;
+   stopping = true;
+}
+
+// Waits until fd is readable or timeout nanoseconds, if not negative, have
+// passed. SIGINT and SIGTERM are blocked but while waiting; returns false if
+// one came.
+static bool wait_for_input(int fd, int_fast64_t timeout) {
+   sigset_t mask;
+   pthread_sigmask(SIG_SETMASK, NULL, &mask);
+   sigdelset(&mask, SIGINT);
+   sigdelset(&mask, SIGTERM);
+
+   struct pollfd p = {.fd = fd, .events = POLLIN};
+   const struct timespec ts = {
+      .tv_sec = (time_t)(timeout / 1000000000),
+      .tv_nsec = (long)(timeout % 1000000000),
+   };
+   (void) ppoll(&p, 1, timeout < 0 ? NULL : &ts, &mask);
+   return !stopping;
+}
+
+// SIGINT and SIGTERM end the input for --follow and --records, which wait for
+// it with them unblocked. Block them before any threads inherit our mask.
+static void catch_stop(void) {
+   const struct sigaction sa = {.sa_handler = stop};
+   sigset_t mask;
+   sigemptyset(&mask);
+   sigaddset(&mask, SIGINT);
+   sigaddset(&mask, SIGTERM);
+   pthread_sigmask(SIG_BLOCK, &mask, NULL);
+   sigaction(SIGINT, &sa, NULL);
+   sigaction(SIGTERM, &sa, NULL);
+}
+
+static void drain(int notify) {
+   char events[4096];
+   if (notify >= 0) {
+      while (read(notify, events, sizeof events) > 0)
+         ;
+   }
+}
+
+// For --follow when decrypting: like read_chunk, but if the input is a
+// regular file, waits for it to grow rather than stopping at its current end.
+// Gives up once it's follow_size octets long, after follow_timeout
+// nanoseconds without growing, or on SIGINT or SIGTERM.
+static size_t read_growing(struct engine *e, FILE *f, unsigned char *buf,
+                           size_t n)
+{
+   size_t r = read_chunk(e, f, buf, n, 0);
+   if (!e->growing)
+      return r;
+
+   for (uint_fast64_t idle_since = now_ns(); r < n;) {
+      clearerr(f);
+      const off_t at = ftello(f);
+      const uint_fast64_t now = now_ns();
+      if ((e->follow_size >= 0 && at >= e->follow_size)
+       || now - idle_since >= e->follow_timeout)
+         break;
+
+      int_fast64_t timeout = (int_fast64_t)(idle_since + e->follow_timeout - now);
+      if (e->notify < 0 && timeout > FOLLOW_POLL)
+         timeout = FOLLOW_POLL;
+      if (!wait_for_input(e->notify, timeout))
+         break;
+      drain(e->notify);
+
+      const size_t x = read_chunk(e, f, buf + r, n - r, 0);
+      if (x)
+         idle_since = now_ns();
+      r += x;
+   }
+   return r;
+}
+
+// Returns the exit status for main.
+static int read_stream(struct engine *e, FILE *input) {
+   const size_t ioffset = e->decrypting ? 0 : crypto_secretbox_ZEROBYTES;
+
+   for (struct chunk *c; e->next_idx < e->end_idx && (c = get_free(e));) {
+      const size_t carried = e->carry_len;
+      if (carried) {
+         memcpy(c->ibuf + ioffset, e->carry, carried);
+         e->carry_len = 0;
+      }
+
+      size_t want = BUFLEN - ioffset - carried;
+      if (e->framed) {
+         // Don't wait for a growing input to have anything after its end.
+         if (e->trailer_read && e->growing)
+            break;
+
+         unsigned char frame[4];
+         const size_t f = read_growing(e, input, frame, sizeof frame);
+         if (!f && e->trailer_read)
+            break;
+         if (UNLIKELY(f < sizeof frame || e->trailer_read)) {
+            fprintf(stderr, "Invalid input: %s at %#" PRIxFAST64 "\n",
+                    e->trailer_read ? "data after the trailer"
+                                    : "no trailer (truncated?)",
+                    e->total_read);
+            return 11;
+         }
+         want = (size_t)frame[0] << 24 | (size_t)frame[1] << 16
+              | (size_t)frame[2] << 8 | frame[3];
+         if (UNLIKELY(want < crypto_secretbox_ZEROBYTES || want > BUFLEN)) {
+            fprintf(stderr, "Invalid input: bad frame length %#zx after "
+                            "%#" PRIxFAST64 "\n", want, e->total_read);
+            return 11;
+         }
+         e->trailer_read = want == crypto_secretbox_ZEROBYTES;
+      }
+
+      // read_full is important so that we get the zero bytes when we expect
+      // them (during decryption) and we output them at the right time (during
+      // encryption).
+      const size_t r = carried
+                     + read_growing(e, input, c->ibuf + ioffset + carried,
+                                    want);
+      if (UNLIKELY(!r))
+         break;
+
+      if (e->decrypting && UNLIKELY(e->framed ? r < want
+                                              : r <= crypto_secretbox_ZEROBYTES))
+         return truncated(e->total_read, r);
+
+      if (UNLIKELY(!plan_chunk(e, c, r, c->ibuf)))
+         return 3;
+
+      if (e->decrypting && UNLIKELY(!check_zeroes(c)))
+         return 11;
+
+      pthread_mutex_lock(&e->lock);
+      enqueue(e, c);
+      pthread_mutex_unlock(&e->lock);
+   }
+   return 0;
+}
+
+// For --follow: like read_stream, but hands a chunk out once it has
+// flush_size octets or has had some for flush_after nanoseconds, whichever
+// comes first. A regular file is read as it grows, waiting on inotify,
+// until SIGINT or SIGTERM; anything else until its end as usual. Either way,
+// the trailer then marks a clean end.
+static int read_follow(struct engine *e, int fd) {
+   struct stat st;
+   const bool regular = !fstat(fd, &st) && S_ISREG(st.st_mode);
+   const int notify = e->notify;
+
+   // Otherwise reads would wait for more with no regard for flush_after.
+   const int fl = fcntl(fd, F_GETFL);
+   if (!regular)
+      (void) fcntl(fd, F_SETFL, fl | O_NONBLOCK);
+
+   int status = 0;
+   for (bool end = false; !end && !status;) {
+      struct chunk *c = get_free(e);
+      if (!c)
+         break;
+
+      size_t r = 0;
+      uint_fast64_t deadline = 0;
+      while (r < e->flush_size) {
+         const ssize_t x = read(fd, c->ibuf + crypto_secretbox_ZEROBYTES + r,
+                                e->flush_size - r);
+         if (x > 0) {
+            if (!r)
+               deadline = now_ns() + e->flush_after;
+            if (e->read_throttle.rate)
+               throttle(&e->read_throttle, (size_t)x);
+            r += (size_t)x;
+            continue;
+         }
+         if (!x && !regular) {
+            end = true;
+            break;
+         }
+         if (x < 0 && errno != EAGAIN && errno != EINTR) {
+            perror("Couldn't read input");
+            status = 1;
+            break;
+         }
+
+         // Nothing more for now.
+         const uint_fast64_t now = now_ns();
+         if (r && now >= deadline)
+            break;
+         int_fast64_t timeout = r ? (int_fast64_t)(deadline - now) : -1;
+         if (regular && notify < 0 && (timeout < 0 || timeout > FOLLOW_POLL))
+            timeout = FOLLOW_POLL;
+         if (!wait_for_input(regular ? notify : fd, timeout)) {
+            end = true;
+            break;
+         }
+         drain(notify);
+      }
+
+      pthread_mutex_lock(&e->lock);
+      if (!r || status) {
+         c->next = e->free;
+         e->free = c;
+      } else if (UNLIKELY(!plan_chunk(e, c, r, NULL))) {
+         status = 3;
+      } else {
+         enqueue(e, c);
+      }
+      pthread_mutex_unlock(&e->lock);
+   }
+
+   if (!status) {
+      struct chunk *c = get_free(e);
+      pthread_mutex_lock(&e->lock);
+      if (c && !plan_chunk(e, c, 0, NULL))
+         status = 3;
+      else if (c)
+         enqueue(e, c);
+      pthread_mutex_unlock(&e->lock);
+   }
+
+   if (!regular)
+      (void) fcntl(fd, F_SETFL, fl);
+   return status;
+}
+
+// For --records: how much of buf, whose first inside octets end a record
+// begun earlier, ends on a record boundary.
+static size_t records_end(const struct engine *e, const unsigned char *buf,
+                          size_t len, size_t inside)
+{
+   if (e->records == RECORDS_LINES) {
+      const unsigned char *nl = memrchr(buf, '\n', len);
+      return nl ? (size_t)(nl - buf) + 1 : 0;
+   }
+
+   size_t end = inside;
+   while (end + 4 <= len) {
+      const size_t next = end + 4 + ((size_t)buf[end] << 24
+                                   | (size_t)buf[end + 1] << 16
+                                   | (size_t)buf[end + 2] << 8 | buf[end + 3]);
+      if (next > len)
+         break;
+      end = next;
+   }
+   return end <= len ? end : 0;
+}
+
+// For --records: seals the first n octets of data in ibuf, after the zeroes,
+// into obuf and writes the box out. Returns the exit status for main.
+static int seal_box(struct engine *e, unsigned char *ibuf, unsigned char *obuf,
+                    size_t n)
+{
+   struct chunk c = {.ibuf = ibuf, .obuf = obuf};
+   if (UNLIKELY(!plan_chunk(e, &c, n, NULL)))
+      return 3;
+   crypto_secretbox(obuf, ibuf, c.len, c.nonce, e->key);
+   if (UNLIKELY(c.new_nonce))
+      memcpy(obuf, c.nonce, NONCE_RANDOMS);
+   hash_chunk(e, &c);
+   digest_add(&e->plain_digest, c.plain_leaf);
+   digest_add(&e->cipher_digest, c.cipher_leaf);
+   if (UNLIKELY(!write_box(e, obuf, c.len))) {
+      fputs("Couldn't write ciphertext to stdout\n", stderr);
+      return 1;
+   }
+   for (size_t i = 0; i < e->ntees; ++i) {
+      if (UNLIKELY(!tee_box(e, &e->tees[i], obuf, c.len)))
+         return 1;
+   }
+   return 0;
+}
+
+// For --records: seals the records on this thread as soon as they're read,
+// as many as there are at once to a box, and writes each box straight out.
+// Handing them to the workers would only add latency. Returns the exit
+// status for main.
+static int seal_records(struct engine *e, int fd) {
+   unsigned char *ibuf = calloc(1, RECORD_BUFLEN),
+                 *obuf = malloc(RECORD_BUFLEN);
+   if (!ibuf || !obuf) {
+      perror("Couldn't malloc buffers");
+      return 4;
+   }
+   unsigned char *const data = ibuf + crypto_secretbox_ZEROBYTES;
+   const size_t cap = RECORD_BUFLEN - crypto_secretbox_ZEROBYTES;
+
+   // len octets have been read, of which the first inside end a record that
+   // didn't fit in the last box.
+   size_t len = 0, inside = 0;
+   int status = 0;
+   for (bool end = false; !end && !status;) {
+      ssize_t x = 0;
+      if (wait_for_input(fd, -1)
+       && (x = read(fd, data + len, cap - len)) < 0 && errno != EINTR)
+      {
+         perror("Couldn't read input");
+         return 1;
+      }
+      end = x == 0;
+      len += x > 0 ? (size_t)x : 0;
+
+      size_t n = end ? len : records_end(e, data, len, inside);
+      if (n) {
+         inside = 0;
+      } else if (len == cap) {
+         // Split the record that doesn't fit.
+         n = len;
+         if (e->records == RECORDS_LENGTHS) {
+            inside = inside ? inside - n
+                            : 4 + ((size_t)data[0] << 24
+                                 | (size_t)data[1] << 16
+                                 | (size_t)data[2] << 8 | data[3]) - n;
+         }
+      }
+      if (n && !(status = seal_box(e, ibuf, obuf, n))) {
+         memmove(data, data + n, len - n);
+         len -= n;
+      }
+   }
+
+   // The trailer is just an empty box.
+   return status ? status : seal_box(e, ibuf, obuf, 0);
+}
+
+// When the input can be read at any offset, chunks are handed out in order
+// but read by several of these at once.
+static void *read_positional(void *arg) {
+   struct engine *e = arg;
+   const size_t ioffset = e->decrypting ? 0 : crypto_secretbox_ZEROBYTES;
+   const size_t isize = BUFLEN - ioffset;
+
+   pthread_mutex_lock(&e->lock);
+   const size_t node = place(e, &e->readers_started);
+   for (;;) {
+      while (!e->free && !e->dispatched && !e->status)
+         pthread_cond_wait(&e->cond, &e->lock);
+      if (e->dispatched || e->status)
+         break;
+
+      const off_t off =
+         e->in_base + (off_t)(chunk_at(e, e->next_idx) * isize);
+      if (e->next_idx >= e->end_idx || off >= e->in_end) {
+         e->dispatched = true;
+         pthread_cond_broadcast(&e->cond);
+         break;
+      }
+      const size_t r = e->in_end - off < (off_t)isize
+                     ? (size_t)(e->in_end - off) : isize;
+
+      if (e->decrypting && UNLIKELY(r <= crypto_secretbox_ZEROBYTES)) {
+         e->read_status = truncated(e->total_read, r);
+         e->dispatched = true;
+         pthread_cond_broadcast(&e->cond);
+         break;
+      }
+
+      struct chunk *c = take(&e->free, NULL, node);
+
+      // If this chunk starts a new nonce, we need its random part right away
+      // to hand out the chunks after it. With chunk nonces, any chunk might.
+      off_t at = off;
+      const int fd = in_at(e, &at);
+      if (e->decrypting && (e->chunk_nonces || UNLIKELY(e->new_nonce_in <= 0))
+       && pread_full(fd, c->ibuf, NONCE_RANDOMS, at) != NONCE_RANDOMS)
+      {
+         perror("Couldn't read input");
+         fail(e, 1);
+         break;
+      }
+      if (UNLIKELY(!plan_chunk(e, c, r, c->ibuf))) {
+         fail(e, 3);
+         break;
+      }
+      pthread_mutex_unlock(&e->lock);
+
+      const bool ok = read_chunk(e, NULL, c->ibuf + ioffset, r, off) == r;
+      if (UNLIKELY(!ok))
+         perror("Couldn't read input");
+      else if (e->drop_cache)
+         (void) posix_fadvise(e->in_fd, off, (off_t)r, POSIX_FADV_DONTNEED);
+      const bool valid = ok && (!e->decrypting || check_zeroes(c));
+
+      pthread_mutex_lock(&e->lock);
+      if (UNLIKELY(!ok)) {
+         fail(e, 1);
+         break;
+      }
+      if (UNLIKELY(!valid)) {
+         // Like read_stream, let what came before this chunk be finished.
+         e->read_status = 11;
+         e->dispatched = true;
+         pthread_cond_broadcast(&e->cond);
+         break;
+      }
+      enqueue(e, c);
+   }
+   pthread_mutex_unlock(&e->lock);
+   return NULL;
+}
+
+// For --resume: checks that the last of the first done chunks of the output
+// opens, with nonce, to what's in the input there. If so, drops whatever
+// follows them and carries on from there as if they had just been written,
+// but under a new nonce.
+static bool resume(struct engine *e, uint_fast64_t done,
+                   const unsigned char *nonce)
+{
+   if (done) {
+      unsigned char *cbuf = malloc(BUFLEN), *pbuf = malloc(BUFLEN),
+                    *ibuf = malloc(CHUNKLEN);
+      if (!cbuf || !pbuf || !ibuf) {
+         perror("Couldn't malloc buffers");
+         return false;
+      }
+      const uint_fast64_t last = done - 1;
+      if (pread_full(STDOUT_FILENO, cbuf, BUFLEN,
+                     (off_t)(HEADERLEN + last * BUFLEN)) != BUFLEN)
+      {
+         fputs("Output is shorter than the checkpoint says\n", stderr);
+         return false;
+      }
+      memset(cbuf, 0, crypto_secretbox_BOXZEROBYTES);
+      if (crypto_secretbox_open(pbuf, cbuf, BUFLEN, nonce, e->key)
+       || pread_full(e->in_fd, ibuf, CHUNKLEN,
+                     e->in_base + (off_t)(last * CHUNKLEN)) != CHUNKLEN
+       || memcmp(pbuf + crypto_secretbox_ZEROBYTES, ibuf, CHUNKLEN))
+      {
+         fputs("Output doesn't match infile and password at the "
+               "checkpoint\n", stderr);
+         return false;
+      }
+      free(cbuf);
+      free(pbuf);
+      free(ibuf);
+   }
+
+   e->out_base = (off_t)(HEADERLEN + done * BUFLEN);
+   if (ftruncate(STDOUT_FILENO, e->out_base)) {
+      perror("Couldn't truncate output");
+      return false;
+   }
+   e->written = e->first_idx = e->next_idx = done;
+   e->total_read = done * CHUNKLEN;
+
+   // The run that left the checkpoint may have sealed chunks past it before
+   // it stopped, under the nonce it would have carried on with, and the input
+   // may since have changed. So start a new one, as FLAG_CHUNK_NONCES lets
+   // any chunk do.
+   e->new_nonce_in = 0;
+   return true;
+}
+
+// Finds the random part of the nonce that chunk end - 1 of an encrypted file
+// is under, starting at base in fd: that of the last chunk up to it with
+// anything in its zeroes, which is start.
+static bool find_prefix(int fd, off_t base, uint_fast64_t end,
+                        unsigned char *nonce, uint_fast64_t *start)
+{
+   for (*start = end; (*start)--;) {
+      if (pread_full(fd, nonce, NONCE_RANDOMS,
+                     base + (off_t)(*start * BUFLEN)) != NONCE_RANDOMS)
+         return false;
+      if (!is_zero(nonce, NONCE_RANDOMS))
+         return true;
+   }
+   *start = 0;
+   return true;
+}
+
+// For --append and --patch: opens the len octets of chunk idx of the output
+// into pbuf, so as to know the password is right before changing anything.
+// Returns the exit status for main.
+static int open_output(const struct engine *e, uint_fast64_t idx, size_t len,
+                       unsigned char *pbuf)
+{
+   unsigned char nonce[crypto_secretbox_NONCEBYTES] = {0};
+   uint_fast64_t start;
+   if (!find_prefix(STDOUT_FILENO, (off_t)HEADERLEN, idx + 1, nonce, &start))
+   {
+      perror("Couldn't read output");
+      return 1;
+   }
+   fill_in_nonce(nonce, idx * CHUNKLEN);
+
+   unsigned char *cbuf = malloc(BUFLEN);
+   if (!cbuf) {
+      perror("Couldn't malloc buffers");
+      return 4;
+   }
+   if (pread_full(STDOUT_FILENO, cbuf, len,
+                  (off_t)(HEADERLEN + idx * BUFLEN)) != len)
+   {
+      perror("Couldn't read output");
+      return 1;
+   }
+   memset(cbuf, 0, crypto_secretbox_BOXZEROBYTES);
+   if (crypto_secretbox_open(pbuf, cbuf, len, nonce, e->key)) {
+      fprintf(stderr, "Invalid output: chunk %" PRIuFAST64 " doesn't open "
+                      "(wrong password?)\n", idx);
+      return 11;
+   }
+   free(cbuf);
+   return 0;
+}
+
+// For --append: finds where the output's plaintext ends. If its last chunk is
+// partial, opens it to be carried over into the first new one, which is
+// sealed in its place; if not, opens the last whole one anyway, to check the
+// password. The new chunks always start a new nonce, so that chunk isn't
+// sealed twice under the same one. Returns the exit status for main.
+static int prepare_append(struct engine *e) {
+   const off_t size = lseek(STDOUT_FILENO, 0, SEEK_END);
+   if (size < (off_t)HEADERLEN) {
+      perror("Couldn't seek output");
+      return 1;
+   }
+   const uint_fast64_t full = (uint_fast64_t)(size - (off_t)HEADERLEN) / BUFLEN;
+   const size_t rem = (size_t)((uint_fast64_t)(size - (off_t)HEADERLEN) % BUFLEN);
+   e->out_base = (off_t)(HEADERLEN + full * BUFLEN);
+
+   // With no chunk to open, nothing would catch a wrong password.
+   if (!full && !rem) {
+      fputs("Can't append to an empty output: there's no chunk to check the "
+            "password with\n", stderr);
+      return 1;
+   }
+   if (rem && rem <= crypto_secretbox_ZEROBYTES)
+      return truncated(full * CHUNKLEN, rem);
+   unsigned char *pbuf = malloc(BUFLEN);
+   if (!pbuf) {
+      perror("Couldn't malloc buffers");
+      return 4;
+   }
+   const int status = open_output(e, rem ? full : full - 1,
+                                  rem ? rem : BUFLEN, pbuf);
+   if (status)
+      return status;
+   if (rem) {
+      e->carry = pbuf + crypto_secretbox_ZEROBYTES;
+      e->carry_len = rem - crypto_secretbox_ZEROBYTES;
+   } else {
+      free(pbuf);
+   }
+
+   if (ftruncate(STDOUT_FILENO, e->out_base)) {
+      perror("Couldn't truncate output");
+      return 1;
+   }
+   e->written = e->first_idx = e->next_idx = full;
+   e->total_read = full * CHUNKLEN;
+   return 0;
+}
+
+// For -d of a --store manifest: reads chunk c, named in the manifest, from
+// its file in the store. Returns the exit status.
+static int fetch_chunk(const struct engine *e, struct chunk *c) {
+   char path[PATH_MAX];
+   store_path(path, e->store, e->ids + c->idx * DIGESTLEN);
+   struct stat st;
+   const int fd = open(path, O_RDONLY | O_CLOEXEC);
+   if (fd < 0 || fstat(fd, &st)) {
+      fprintf(stderr, "Couldn't open %s: %s\n", path, strerror(errno));
+      return 1;
+   }
+   const bool ok = st.st_size > crypto_secretbox_ZEROBYTES
+                && st.st_size <= BUFLEN
+                && pread_full(fd, c->ibuf, (size_t)st.st_size, 0)
+                   == (size_t)st.st_size;
+   close(fd);
+   if (!ok || is_zero(c->ibuf, NONCE_RANDOMS)) {
+      fprintf(stderr, "Invalid store: %s isn't a chunk\n", path);
+      return 11;
+   }
+
+   c->len = (size_t)st.st_size;
+   c->new_nonce = true;
+   c->trailer = false;
+   memcpy(c->nonce, c->ibuf, NONCE_RANDOMS);
+   memset(c->nonce + NONCE_RANDOMS, 0, sizeof c->nonce - NONCE_RANDOMS);
+   return check_zeroes(c) ? 0 : 11;
+}
+
+// For -d of a --store manifest: like read_positional, but handing out the
+// chunks the manifest names, each read from the store.
+static void *read_store(void *arg) {
+   struct engine *e = arg;
+
+   pthread_mutex_lock(&e->lock);
+   const size_t node = place(e, &e->readers_started);
+   for (;;) {
+      while (!e->free && !e->dispatched && !e->status)
+         pthread_cond_wait(&e->cond, &e->lock);
+      if (e->dispatched || e->status)
+         break;
+      if (e->next_idx >= e->nids) {
+         e->dispatched = true;
+         pthread_cond_broadcast(&e->cond);
+         break;
+      }
+
+      struct chunk *c = take(&e->free, NULL, node);
+      c->idx = e->next_idx++;
+      pthread_mutex_unlock(&e->lock);
+
+      const int status = fetch_chunk(e, c);
+
+      pthread_mutex_lock(&e->lock);
+      if (UNLIKELY(status)) {
+         // Like read_stream, let what came before this chunk be finished.
+         e->read_status = status;
+         e->dispatched = true;
+         pthread_cond_broadcast(&e->cond);
+         break;
+      }
+      enqueue(e, c);
+   }
+   pthread_mutex_unlock(&e->lock);
+   return NULL;
+}
+
+// For --store: seals the manifest on this thread, the names of the chunks
+// written going after the header like any plaintext. Returns the exit status
+// for main.
+static int seal_manifest(struct engine *e) {
+   const size_t n = 8 + e->written * DIGESTLEN;
+   unsigned char *m = malloc(n), *ibuf = calloc(1, BUFLEN),
+                 *obuf = malloc(BUFLEN);
+   if (!m || !ibuf || !obuf) {
+      perror("Couldn't malloc the manifest");
+      return 4;
+   }
+   put_be64(m, e->written);
+   if (e->written)
+      memcpy(m + 8, e->ids, e->written * DIGESTLEN);
+
+   e->next_idx = e->total_read = 0;
+   e->new_nonce_in = 0;
+   for (size_t off = 0; off < n;) {
+      const size_t r = n - off < CHUNKLEN ? n - off : CHUNKLEN;
+      struct chunk c = {.ibuf = ibuf, .obuf = obuf};
+      memcpy(ibuf + crypto_secretbox_ZEROBYTES, m + off, r);
+      if (UNLIKELY(!plan_chunk(e, &c, r, NULL)))
+         return 3;
+      crypto_secretbox(obuf, ibuf, c.len, c.nonce, e->key);
+      if (c.new_nonce)
+         memcpy(obuf, c.nonce, NONCE_RANDOMS);
+      if (!write_box(e, obuf, c.len)) {
+         fputs("Couldn't write the manifest to stdout\n", stderr);
+         return 1;
+      }
+      for (size_t i = 0; i < e->ntees; ++i) {
+         if (!tee_box(e, &e->tees[i], obuf, c.len))
+            return 1;
+      }
+      off += r;
+   }
+   free(m);
+   free(ibuf);
+   free(obuf);
+   return 0;
+}
+
+// For -d of a --store manifest: opens it from the rest of input, leaving the
+// chunks' names in ids. Returns the exit status for main.
+static int open_manifest(struct engine *e, FILE *input) {
+   unsigned char *ibuf = malloc(BUFLEN), *obuf = malloc(BUFLEN), *m = NULL;
+   size_t len = 0;
+   if (!ibuf || !obuf) {
+      perror("Couldn't malloc buffers");
+      return 4;
+   }
+   for (size_t r; (r = read_full(input, ibuf, BUFLEN));) {
+      if (r <= crypto_secretbox_ZEROBYTES)
+         return truncated(e->total_read, r);
+      struct chunk c = {.ibuf = ibuf, .obuf = obuf};
+      if (!plan_chunk(e, &c, r, ibuf) || !check_zeroes(&c))
+         return 11;
+      if (crypto_secretbox_open(obuf, ibuf, r, c.nonce, e->key)) {
+         fputs("Invalid input: the manifest doesn't open (wrong password?)\n",
+               stderr);
+         return 11;
+      }
+      unsigned char *grown = realloc(m, len + r - crypto_secretbox_ZEROBYTES);
+      if (!grown) {
+         perror("Couldn't malloc the manifest");
+         return 4;
+      }
+      m = grown;
+      memcpy(m + len, obuf + crypto_secretbox_ZEROBYTES,
+             r - crypto_secretbox_ZEROBYTES);
+      len += r - crypto_secretbox_ZEROBYTES;
+   }
+   free(ibuf);
+   free(obuf);
+
+   if (len < 8 || (len - 8) % DIGESTLEN
+    || get_be64(m) != (len - 8) / DIGESTLEN)
+   {
+      fputs("Invalid input: bad manifest (truncated?)\n", stderr);
+      return 11;
+   }
+   e->ids = m + 8;
+   e->nids = get_be64(m);
+   e->next_idx = e->total_read = 0;
+   return 0;
+}
+
+// For -d --volumes: returns the highest index of any volume in the
+// directories they're in, or 0 if there's none past the first.
+static size_t last_volume(const struct volumes *v) {
+   const char *slash = strrchr(v->prefix, '/');
+   const char *base = slash ? slash + 1 : v->prefix;
+   const size_t base_len = strlen(base);
+   char here[PATH_MAX] = ".";
+   if (slash) {
+      snprintf(here, sizeof here, "%.*s",
+               (int)(slash - v->prefix) + (slash == v->prefix), v->prefix);
+   }
+   size_t last = 0;
+   for (size_t i = 0; i < (v->ndirs ? v->ndirs : 1); ++i) {
+      DIR *dir = opendir(v->ndirs ? v->dirs[i] : here);
+      if (!dir)
+         continue;
+      for (struct dirent *d; (d = readdir(dir));) {
+         const char *suffix = d->d_name + base_len;
+         if (strncmp(d->d_name, base, base_len) || *suffix != '.'
+          || strlen(suffix + 1) < 3
+          || strspn(suffix + 1, "0123456789") != strlen(suffix + 1))
+            continue;
+         const size_t idx = (size_t)strtoull(suffix + 1, NULL, 10);
+         if (idx > last)
+            last = idx;
+      }
+      closedir(dir);
+   }
+   return last;
+}
+
+// For -d --volumes: opens the volumes after infile, the first, for as long as
+// there are more, and checks that all but the last hold as many chunks as the
+// first. Returns the exit status for main.
+static int open_volumes(struct engine *e) {
+   struct volumes *v = e->volumes;
+   const off_t full = (e->in_end - e->in_base) / (off_t)BUFLEN * (off_t)BUFLEN;
+   off_t total = e->in_end - e->in_base, last = total;
+   char path[PATH_MAX];
+   v->base = e->in_base;
+   v->per_volume = (uint_fast64_t)full / BUFLEN;
+   for (int fd = e->in_fd;;) {
+      if (v->n == v->cap) {
+         const size_t want = v->cap ? v->cap * 2 : 16;
+         int *grown = realloc(v->fds, want * sizeof *grown);
+         if (!grown) {
+            perror("Couldn't malloc volumes");
+            return 4;
+         }
+         v->fds = grown;
+         v->cap = want;
+      }
+      v->fds[v->n++] = fd;
+
+      volume_path(path, v, v->n);
+      if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+         break;
+      if (last != full || !full) {
+         fprintf(stderr, "Invalid input: volume %zu isn't full, but there's "
+                         "another after it\n", v->n - 1);
+         return 1;
+      }
+      if ((last = lseek(fd, 0, SEEK_END)) < 0) {
+         fprintf(stderr, "Couldn't seek %s: %s\n", path, strerror(errno));
+         return 1;
+      }
+      if (last > full) {
+         fprintf(stderr, "Invalid input: volume %zu is bigger than volume 0\n",
+                 v->n);
+         return 1;
+      }
+      total += last;
+   }
+   if (errno != ENOENT) {
+      fprintf(stderr, "Couldn't open %s: %s\n", path, strerror(errno));
+      return 1;
+   }
+
+   // A missing volume would otherwise look like the end.
+   if (last_volume(v) > v->n) {
+      fprintf(stderr, "Invalid input: volume %zu is missing\n", v->n);
+      return 1;
+   }
+
+   if (v->n == 1)
+      v->per_volume = UINT_FAST64_MAX;
+   e->in_base = 0;
+   e->in_end = total;
+   return 0;
+}
+
+// For --merkle: builds the trailer, the tree over the tags of the chunks
+// written and its footer. Returns the exit status for main.
+static int seal_tree(const struct engine *e, unsigned char **trailer,
+                     size_t *len)
+{
+   const uint_fast64_t n = e->written;
+   const size_t nodes = merkle_nodes(n) * DIGESTLEN;
+   unsigned char *t = malloc(nodes + MERKLE_FOOTER);
+   if (!t) {
+      perror("Couldn't malloc the tree");
+      return 4;
+   }
+   for (uint_fast64_t i = 0; i < n; ++i)
+      merkle_hash(t + i * DIGESTLEN, 0,
+                  e->tags + i * crypto_secretbox_MACBYTES,
+                  crypto_secretbox_MACBYTES);
+
+   unsigned char *footer = t + nodes,
+                 m[crypto_secretbox_ZEROBYTES + DIGESTLEN + 8] = {0},
+                 c[sizeof m];
+   merkle_build(t, n, m + crypto_secretbox_ZEROBYTES);
+   put_be64(m + crypto_secretbox_ZEROBYTES + DIGESTLEN, n);
+   if (read_full(e->urandom, footer, crypto_secretbox_NONCEBYTES)
+       != crypto_secretbox_NONCEBYTES)
+   {
+      fputs("/dev/urandom failed to provide\n", stderr);
+      return 3;
+   }
+   crypto_secretbox(c, m, sizeof m, footer, e->key);
+   memcpy(footer + crypto_secretbox_NONCEBYTES,
+          c + crypto_secretbox_BOXZEROBYTES,
+          sizeof c - crypto_secretbox_BOXZEROBYTES);
+   put_be64(footer + MERKLE_FOOTER - 8, n);
+
+   *trailer = t;
+   *len = nodes + MERKLE_FOOTER;
+   return 0;
+}
+
+// For -d of a --merkle input: reads the trailer from the end of infile and
+// checks that its root opens, that the tree adds up to it, and that it's over
+// as many chunks as come before it, which are then all that's left to read.
+// Returns the exit status for main.
+static int read_tree(struct engine *e, unsigned char **trailer, size_t *len)
+{
+   const off_t size = e->in_end - e->in_base;
+   unsigned char count[8];
+   if (size < (off_t)MERKLE_FOOTER
+    || pread_full(e->in_fd, count, sizeof count, e->in_end - 8) != 8)
+   {
+      fputs("Invalid input: no room for its tree (truncated?)\n", stderr);
+      return 11;
+   }
+   const uint_fast64_t n = get_be64(count);
+   const size_t nodes =
+      n < (uint_fast64_t)size / DIGESTLEN ? merkle_nodes(n) * DIGESTLEN : 0;
+   if (!nodes != !n || nodes + MERKLE_FOOTER > (size_t)size) {
+      fprintf(stderr, "Invalid input: its tree can't be over %" PRIuFAST64
+                      " chunks\n", n);
+      return 11;
+   }
+
+   unsigned char *t = malloc(nodes + MERKLE_FOOTER), *check = malloc(nodes);
+   if (!t || !check) {
+      perror("Couldn't malloc the tree");
+      return 4;
+   }
+   const off_t off = e->in_end - (off_t)(nodes + MERKLE_FOOTER);
+   if (pread_full(e->in_fd, t, nodes + MERKLE_FOOTER, off)
+       != nodes + MERKLE_FOOTER)
+   {
+      perror("Couldn't read input");
+      return 1;
+   }
+
+   const unsigned char *footer = t + nodes;
+   unsigned char c[crypto_secretbox_ZEROBYTES + DIGESTLEN + 8] = {0},
+                 m[sizeof c], root[DIGESTLEN];
+   memcpy(c + crypto_secretbox_BOXZEROBYTES,
+          footer + crypto_secretbox_NONCEBYTES,
+          sizeof c - crypto_secretbox_BOXZEROBYTES);
+   if (crypto_secretbox_open(m, c, sizeof c, footer, e->key)
+    || get_be64(m + crypto_secretbox_ZEROBYTES + DIGESTLEN) != n)
+   {
+      fputs("Invalid input: the root of its tree doesn't open (wrong "
+            "password?)\n", stderr);
+      return 11;
+   }
+   memcpy(check, t, n * DIGESTLEN);
+   merkle_build(check, n, root);
+   if (memcmp(check, t, nodes)
+    || memcmp(root, m + crypto_secretbox_ZEROBYTES, DIGESTLEN))
+   {
+      fputs("Invalid input: its tree doesn't add up to its root\n", stderr);
+      return 11;
+   }
+   free(check);
+
+   const uint_fast64_t data = (uint_fast64_t)(off - e->in_base),
+                       chunks = data / BUFLEN + !!(data % BUFLEN);
+   if (chunks != n) {
+      fprintf(stderr, "Invalid input: %" PRIuFAST64 " chunks, but its tree "
+                      "is over %" PRIuFAST64 "\n", chunks, n);
+      return 11;
+   }
+   e->in_end = off;
+   e->tree = t;
+   *trailer = t;
+   *len = nodes + MERKLE_FOOTER;
+   return 0;
+}
+
+static int chunk_cmp(const void *a, const void *b) {
+   const uint_fast64_t *x = a, *y = b;
+   return (*x > *y) - (*x < *y);
+}
+
+// For --patch: reads the plaintext ranges in list, a decimal offset and
+// length each, and plans to seal just the chunks they touch again, in their
+// places in the output. An untouched chunk right after a touched one might be
+// under the nonce that one is about to lose: it first gets that nonce's
+// random part written into its zeroes, which leaves it under the same nonce
+// but no longer depending on the chunks before it. Returns the exit status
+// for main.
+static int prepare_patch(struct engine *e, const char *list) {
+   const off_t size = lseek(STDOUT_FILENO, 0, SEEK_END);
+   if (size < (off_t)HEADERLEN) {
+      perror("Couldn't seek output");
+      return 1;
+   }
+   const uint_fast64_t boxes = (uint_fast64_t)(size - (off_t)HEADERLEN),
+                       total = boxes / BUFLEN + !!(boxes % BUFLEN);
+   if (boxes % BUFLEN && boxes % BUFLEN <= crypto_secretbox_ZEROBYTES)
+      return truncated(boxes / BUFLEN * CHUNKLEN, boxes % BUFLEN);
+   const uint_fast64_t plain = boxes - total * crypto_secretbox_ZEROBYTES;
+   if ((uint_fast64_t)(e->in_end - e->in_base) != plain) {
+      fprintf(stderr, "Infile has %jd octets, but outfile %" PRIuFAST64 ": "
+                      "--patch can't change that\n",
+              (intmax_t)(e->in_end - e->in_base), plain);
+      return 1;
+   }
+
+   FILE *f = fopen(list, "r");
+   if (!f) {
+      perror("Couldn't open patch list");
+      return 1;
+   }
+   uint_fast64_t *chunks = NULL;
+   size_t n = 0, cap = 0;
+   for (unsigned long long off, len;;) {
+      const int got = fscanf(f, "%llu %llu", &off, &len);
+      if (got == EOF)
+         break;
+      if (got != 2 || len > plain || off > plain - len) {
+         fprintf(stderr, "Invalid patch list: each line should be an offset "
+                         "and a length in decimal,\nwithin the %" PRIuFAST64
+                         " octets of plaintext\n", plain);
+         return 1;
+      }
+      if (!len)
+         continue;
+      for (uint_fast64_t i = off / CHUNKLEN; i <= (off + len - 1) / CHUNKLEN;
+           ++i)
+      {
+         if (n + 1 >= cap) {
+            cap = cap ? cap * 2 : 1024;
+            uint_fast64_t *grown = realloc(chunks, cap * sizeof *chunks);
+            if (!grown) {
+               perror("Couldn't malloc the patch list");
+               return 4;
+            }
+            chunks = grown;
+         }
+         chunks[n++] = i;
+      }
+   }
+   fclose(f);
+   if (!chunks && !(chunks = malloc(sizeof *chunks))) {
+      perror("Couldn't malloc the patch list");
+      return 4;
+   }
+
+   qsort(chunks, n, sizeof *chunks, chunk_cmp);
+   size_t kept = 0;
+   for (size_t i = 0; i < n; ++i) {
+      if (!kept || chunks[kept - 1] != chunks[i])
+         chunks[kept++] = chunks[i];
+   }
+   n = kept;
+   chunks[n] = total;
+
+   // Checked before anything is written, since chunks sealed under another
+   // password would just open as zeroes.
+   if (n) {
+      unsigned char *pbuf = malloc(BUFLEN);
+      if (!pbuf) {
+         perror("Couldn't malloc buffers");
+         return 4;
+      }
+      const int status = open_output(e, chunks[0], chunks[0] + 1 < total
+                                     ? BUFLEN
+                                     : (size_t)(boxes - chunks[0] * BUFLEN),
+                                     pbuf);
+      free(pbuf);
+      if (status)
+         return status;
+   }
+
+   for (size_t i = 0; i < n; ++i) {
+      const uint_fast64_t next = chunks[i] + 1;
+      if (next == chunks[i + 1] || next == total)
+         continue;
+      const off_t at = (off_t)(HEADERLEN + next * BUFLEN);
+      unsigned char prefix[crypto_secretbox_NONCEBYTES];
+      uint_fast64_t start;
+      if (pread_full(STDOUT_FILENO, prefix, NONCE_RANDOMS, at) != NONCE_RANDOMS
+       || (is_zero(prefix, NONCE_RANDOMS)
+        && (!find_prefix(STDOUT_FILENO, (off_t)HEADERLEN, next, prefix,
+                         &start)
+         || pwrite_full(STDOUT_FILENO, prefix, NONCE_RANDOMS, at)
+            != NONCE_RANDOMS)))
+      {
+         perror("Couldn't update output");
+         return 1;
+      }
+   }
+
+   if (e->verbose)
+      fprintf(stderr, "Sealing %zu of %" PRIuFAST64 " chunks again\n", n,
+              total);
+   e->patch = chunks;
+   e->end_idx = n;
+   e->out_base = (off_t)HEADERLEN;
+   return 0;
+}
+
+// Sets up attr for threads with STACKLEN stacks. Returns false on failure.
+static bool stack_attr(pthread_attr_t *attr) {
+   if (pthread_attr_init(attr) || pthread_attr_setstacksize(attr, STACKLEN)) {
+      fputs("Couldn't set up threads\n", stderr);
+      return false;
+   }
+   return true;
+}
+
+// Starts n threads running f, the ith given args + i * size.
+static bool spawn(pthread_t *threads, size_t n, void *(*f)(void *),
+                  void *args, size_t size)
+{
+   pthread_attr_t attr;
+   if (!stack_attr(&attr))
+      return false;
+   for (size_t i = 0; i < n; ++i) {
+      const int err = pthread_create(&threads[i], &attr, f,
+                                     (char *)args + i * size);
+      if (err) {
+         fprintf(stderr, "Couldn't create thread: %s\n", strerror(err));
+         return false;
+      }
+   }
+   return true;
+}
+
+// Returns the exit status for main. depth is the number of positional reads
+// to keep in flight, or zero to read the input as a stream.
+static int run_engine(struct engine *e, size_t jobs, size_t depth,
+                      FILE *input)
+{
+   // Whoever waits on a framed stream can have the header right away.
+   if (e->framed && !e->decrypting)
+      (void) fflush(stdout);
+
+   if (e->records) {
+      catch_stop();
+      return seal_records(e, fileno(input));
+   }
+
+   // Twice as many chunks as workers lets the reader stay ahead of them, and
+   // every additional read in flight needs its own. With --numa, each node
+   // gets chunks for its own workers and readers, in memory local to it.
+   const size_t lag = e->ntees ? e->tee_lag : 0;
+   e->nchunks = jobs * 2 + (depth ? depth - 1 : 0) + lag;
+   if (e->nnodes) {
+      for (size_t i = 0; i < jobs; ++i)
+         ++e->nodes[i % e->nnodes].workers;
+      for (size_t i = 0; i < depth; ++i)
+         ++e->nodes[i % e->nnodes].readers;
+      for (size_t i = 0; i < lag; ++i)
+         ++e->nodes[i % e->nnodes].chunks;
+      e->nchunks = 0;
+      for (size_t i = 0; i < e->nnodes; ++i)
+         e->nchunks += e->nodes[i].chunks += e->nodes[i].workers * 2
+                                           + e->nodes[i].readers;
+   }
+
+   e->done = calloc(e->nchunks, sizeof *e->done);
+   if (!e->done) {
+      perror("Couldn't malloc buffers");
+      return 4;
+   }
+   for (size_t node = 0; node < (e->nnodes ? e->nnodes : 1); ++node) {
+      if (e->nnodes)
+         set_policy(MPOL_PREFERRED, &e->nodes[node], 1);
+
+      const size_t n = e->nnodes ? e->nodes[node].chunks : e->nchunks;
+      for (size_t i = 0; i < n; ++i) {
+         struct chunk *c = malloc(sizeof *c);
+         unsigned char *ibuf = malloc(BUFLEN), *obuf = malloc(BUFLEN);
+         if (!c || !ibuf || !obuf) {
+            perror("Couldn't malloc buffers");
+            return 4;
+         }
+         memset(ibuf, 0, crypto_secretbox_ZEROBYTES);
+         c->ibuf = ibuf;
+         c->obuf = obuf;
+         c->node = node;
+         c->next = e->free;
+         e->free = c;
+      }
+   }
+   if (e->nnodes)
+      set_policy(MPOL_DEFAULT, NULL, 0);
+   e->queue_tail = &e->queue;
+
+   if (e->verbose) {
+      for (size_t i = 0; i < e->nnodes; ++i) {
+         fprintf(stderr, "NUMA node %d (CPUs ", e->nodes[i].id);
+         print_cpus(&e->nodes[i].cpus);
+         fprintf(stderr, "): %zu workers, %zu readers, %zu chunks\n",
+                 e->nodes[i].workers, e->nodes[i].readers,
+                 e->nodes[i].chunks);
+      }
+   }
+
+   pthread_t *workers = malloc(jobs * sizeof *workers),
+             *readers = malloc(depth * sizeof *readers),
+             *tee_writers = malloc(e->ntees * sizeof *tee_writers);
+   if (!workers || !readers || !tee_writers) {
+      perror("Couldn't malloc threads");
+      return 4;
+   }
+   if (e->follow)
+      catch_stop();
+
+   e->released = e->written;
+   for (size_t i = 0; i < e->ntees; ++i) {
+      e->tees[i].e = e;
+      e->tees[i].next = e->written;
+   }
+   if (!spawn(workers, jobs, work, e, 0)
+    || !spawn(tee_writers, e->ntees, write_tee, e->tees, sizeof *e->tees))
+      return 4;
+
+   if (e->drop_cache && depth)
+      (void) posix_fadvise(e->in_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+   // A growing regular file is waited on with inotify if we can.
+   struct stat st;
+   e->notify = -1;
+   if (e->follow && !fstat(fileno(input), &st) && S_ISREG(st.st_mode)) {
+      e->growing = e->decrypting;
+      if ((e->notify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) >= 0
+       && inotify_add_watch(e->notify, e->follow, IN_MODIFY) < 0)
+      {
+         close(e->notify);
+         e->notify = -1;
+      }
+   }
+
+   int status;
+   if (e->follow && !e->decrypting) {
+      status = read_follow(e, fileno(input));
+   } else if (depth) {
+      if (!spawn(readers, depth,
+                 e->store && e->decrypting ? read_store : read_positional, e,
+                 0))
+         return 4;
+      for (size_t i = 0; i < depth; ++i)
+         pthread_join(readers[i], NULL);
+      status = e->read_status;
+   } else {
+      status = read_stream(e, input);
+   }
+
+   // Let the workers finish what was read before stopping, as if we had been
+   // doing this all one chunk at a time.
+   pthread_mutex_lock(&e->lock);
+   e->eof = true;
+   pthread_cond_broadcast(&e->cond);
+   pthread_mutex_unlock(&e->lock);
+   for (size_t i = 0; i < jobs; ++i)
+      pthread_join(workers[i], NULL);
+
+   pthread_mutex_lock(&e->lock);
+   e->finished = true;
+   pthread_cond_broadcast(&e->cond);
+   pthread_mutex_unlock(&e->lock);
+   for (size_t i = 0; i < e->ntees; ++i)
+      pthread_join(tee_writers[i], NULL);
+
+   if (e->status)
+      return e->status;
+
+   // The last few chunks are still in the page cache, at least those that
+   // have been written back by now.
+   if (e->drop_cache && e->out_base >= 0) {
+      (void) posix_fadvise(STDOUT_FILENO, e->out_base, (off_t)e->out_len,
+                           POSIX_FADV_DONTNEED);
+   }
+
+   // pwrite doesn't move the file offset, so leave it where writing
+   // everything in order would have.
+   if (e->out_base >= 0
+    && lseek(STDOUT_FILENO, e->out_base + (off_t)e->out_len, SEEK_SET) < 0)
+   {
+      perror("Couldn't seek stdout");
+      return 1;
+   }
+   return status;
+}
+
+// For --mount: a chunk of plaintext, at ZEROBYTES in buf, or being opened
+// there by the thread that set loading, or one that didn't open. Slots in use
+// by no one are taken for other chunks least recently used first.
+struct cached {
+   uint_fast64_t idx, used;
+   unsigned char *buf;
+   size_t len, users;
+   bool filled, loading, bad;
+   char pad[5];
+};
+
+// For --mount: the archive, as an engine that's never run, and the one file
+// made of its plaintext. With --mount-map, that's also mapped at map, whose
+// pages uffd faults on until they're filled; chunks that didn't open when
+// they were are set in bad. Only the nresident chunks in resident, the last
+// to be filled, keep their pages, and those with pins being read don't lose
+// them.
+struct mount {
+   struct engine *e;
+   int fuse, uffd, unmap[2];
+   const char *name;
+   uint_fast64_t size, nchunks, clock, last_read;
+   struct timespec mtime;
+   struct cached *cache;
+   size_t ncache, page, map_len, nresident, hand;
+   uint_fast64_t *resident;
+   size_t *pins;
+   unsigned char *map, *bad, *fault_box, *fault_page;
+   pthread_t faults;
+};
+
+// The node ID of the one file under the root.
+#define MOUNT_FILE_ID 2
+
+// For --mount: opens chunk idx of infile into buf, using box to read it into.
+// Returns whether it opened and, if given a tree, was in it.
+static bool open_chunk(const struct engine *e, uint_fast64_t idx,
+                       unsigned char *box, unsigned char *buf, size_t *len)
+{
+   const off_t off = e->in_base + (off_t)(idx * BUFLEN);
+   const size_t r = e->in_end - off < (off_t)BUFLEN
+                  ? (size_t)(e->in_end - off) : BUFLEN;
+   if (pread_full(e->in_fd, box, r, off) != r)
+      return false;
+
+   unsigned char nonce[crypto_secretbox_NONCEBYTES];
+   uint_fast64_t start = idx;
+   if (!is_zero(box, NONCE_RANDOMS))
+      memcpy(nonce, box, NONCE_RANDOMS);
+   else if (!find_prefix(e->in_fd, e->in_base, idx, nonce, &start))
+      return false;
+   fill_in_nonce(nonce, (e->chunk_nonces ? idx : start) * CHUNKLEN);
+   memset(box, 0, NONCE_RANDOMS);
+
+   if (e->tree) {
+      unsigned char leaf[DIGESTLEN];
+      merkle_hash(leaf, 0, box + crypto_secretbox_BOXZEROBYTES,
+                  crypto_secretbox_MACBYTES);
+      if (memcmp(leaf, e->tree + idx * DIGESTLEN, DIGESTLEN))
+         return false;
+   }
+   *len = r - crypto_secretbox_ZEROBYTES;
+   unsigned char id[DIGESTLEN];
+   if (e->shared) {
+      shared_id(e->key, nonce, box, id);
+      if (shared_get(e->shared, id, buf + crypto_secretbox_ZEROBYTES, *len))
+         return true;
+   }
+   if (crypto_secretbox_open(buf, box, r, nonce, e->key))
+      return false;
+   if (e->shared)
+      shared_put(e->shared, id, buf + crypto_secretbox_ZEROBYTES, *len);
+   return true;
+}
+
+// For --mount: chunk idx from the cache, opened into it first if it's not
+// there, for the caller to let go of with drop_cached. NULL if it doesn't
+// open, which is remembered like any other chunk.
+static struct cached *get_cached(struct mount *m, uint_fast64_t idx,
+                                 unsigned char *box)
+{
+   struct engine *e = m->e;
+   pthread_mutex_lock(&e->lock);
+   struct cached *c, *victim;
+   for (;;) {
+      c = victim = NULL;
+      for (size_t i = 0; i < m->ncache && !c; ++i) {
+         struct cached *x = &m->cache[i];
+         if (x->filled && x->idx == idx)
+            c = x;
+         else if (!x->users && (!victim || victim->used > x->used))
+            victim = x;
+      }
+      if (c ? !c->loading : victim != NULL)
+         break;
+      pthread_cond_wait(&e->cond, &e->lock);
+   }
+   if (c) {
+      c->used = ++m->clock;
+      if (!c->bad)
+         ++c->users;
+      pthread_mutex_unlock(&e->lock);
+      return c->bad ? NULL : c;
+   }
+
+   *victim = (struct cached){
+      .idx = idx,
+      .used = ++m->clock,
+      .buf = victim->buf,
+      .users = 1,
+      .filled = true,
+      .loading = true,
+   };
+   pthread_mutex_unlock(&e->lock);
+   const bool ok = open_chunk(e, idx, box, victim->buf, &victim->len);
+   if (!ok) {
+      fprintf(stderr, "Invalid input: chunk %" PRIuFAST64 " doesn't open\n",
+              idx);
+   }
+   pthread_mutex_lock(&e->lock);
+   victim->loading = false;
+   if (!ok) {
+      victim->bad = true;
+      victim->users = 0;
+   }
+   pthread_cond_broadcast(&e->cond);
+   pthread_mutex_unlock(&e->lock);
+   return ok ? victim : NULL;
+}
+
+static void drop_cached(struct mount *m, struct cached *c) {
+   pthread_mutex_lock(&m->e->lock);
+   --c->users;
+   pthread_cond_broadcast(&m->e->cond);
+   pthread_mutex_unlock(&m->e->lock);
+}
+
+// For --mount-map: drops the pages of chunk idx from the map, but for any it
+// shares with a neighbour being read, so that they fault again when next
+// touched. Called with the engine's lock held.
+static void drop_map(struct mount *m, uint_fast64_t idx) {
+   const size_t pg = m->page;
+   const uint_fast64_t start = idx * CHUNKLEN,
+                       end = m->size - start < CHUNKLEN ? m->size
+                                                        : start + CHUNKLEN,
+                       lo = (idx && m->pins[idx - 1] ? start + pg - 1 : start)
+                          / pg * pg,
+                       hi = (idx + 1 < m->nchunks && m->pins[idx + 1]
+                             ? end : end + pg - 1) / pg * pg;
+   if (lo >= hi)
+      return;
+   // The pages are locked, which older kernels won't drop without unlocking
+   // them first.
+   unsigned char *at = m->map + lo;
+   const size_t len = (size_t)(hi - lo);
+   if (madvise(at, len, MADV_DONTNEED_LOCKED) && errno == EINVAL
+    && (munlock(at, len) || madvise(at, len, MADV_DONTNEED)
+        || mlock2(at, len, MLOCK_ONFAULT)))
+      perror("Couldn't drop pages of the map");
+}
+
+// For --mount-map: notes that chunk idx is having its pages filled, first
+// dropping those of the chunk noted longest ago that isn't being read if
+// there are already nresident.
+static void map_resident(struct mount *m, uint_fast64_t idx) {
+   size_t slot = m->nresident;
+   for (size_t i = 0; i < m->nresident; ++i) {
+      if (m->resident[i] == idx)
+         return;
+      if (m->resident[i] == UINT_FAST64_MAX)
+         slot = i;
+   }
+   // Reads pin at most two chunks each, and there are more than twice as
+   // many resident as there are reading, so one is always free to go.
+   pthread_mutex_lock(&m->e->lock);
+   for (size_t i = 0; slot == m->nresident && i < m->nresident; ++i) {
+      if (!m->pins[m->resident[m->hand]]) {
+         drop_map(m, m->resident[m->hand]);
+         slot = m->hand;
+      }
+      m->hand = (m->hand + 1) % m->nresident;
+   }
+   pthread_mutex_unlock(&m->e->lock);
+   if (slot < m->nresident)
+      m->resident[slot] = idx;
+}
+
+// For --mount-map: fills the page of the map at off, and if it lies wholly
+// within one chunk, all the other pages that do. Pages past the end are
+// zeroes, as are those of chunks that don't open, which are set in bad.
+static void fill_fault(struct mount *m, uint_fast64_t off) {
+   const size_t pg = m->page;
+   const uint_fast64_t idx = off / CHUNKLEN, start = idx * CHUNKLEN,
+                       end = m->size - start < CHUNKLEN ? m->size
+                                                        : start + CHUNKLEN,
+                       lo = (start + pg - 1) / pg * pg, hi = end / pg * pg;
+   struct cached *c[2] = {NULL, NULL};
+   uint_fast64_t at = off, len = pg, bad = UINT_FAST64_MAX;
+   const unsigned char *src = m->fault_page;
+   map_resident(m, idx);
+   if (off >= lo && off + pg <= hi) {
+      at = lo;
+      len = hi - lo;
+      if ((c[0] = get_cached(m, idx, m->fault_box)))
+         src = c[0]->buf + crypto_secretbox_ZEROBYTES + (lo - start);
+      else
+         bad = idx;
+   } else {
+      memset(m->fault_page, 0, pg);
+      const uint_fast64_t stop = m->size - off < pg ? m->size : off + pg;
+      for (uint_fast64_t from = off, i = 0; from < stop; ++i) {
+         const uint_fast64_t within = from % CHUNKLEN;
+         const size_t n = (size_t)(stop - from < CHUNKLEN - within
+                                   ? stop - from : CHUNKLEN - within);
+         if (!(c[i] = get_cached(m, from / CHUNKLEN, m->fault_box))) {
+            bad = from / CHUNKLEN;
+            break;
+         }
+         memcpy(m->fault_page + (from - off),
+                c[i]->buf + crypto_secretbox_ZEROBYTES + within, n);
+         from += n;
+      }
+   }
+
+   int r;
+   if (bad != UINT_FAST64_MAX) {
+      pthread_mutex_lock(&m->e->lock);
+      m->bad[bad / 8] |= (unsigned char)(1U << bad % 8);
+      pthread_mutex_unlock(&m->e->lock);
+      struct uffdio_zeropage z = {.range = {(uintptr_t)(m->map + at), len}};
+      r = ioctl(m->uffd, UFFDIO_ZEROPAGE, &z);
+   } else {
+      struct uffdio_copy copy = {
+         .dst = (uintptr_t)(m->map + at),
+         .src = (uintptr_t)src,
+         .len = len,
+      };
+      r = ioctl(m->uffd, UFFDIO_COPY, &copy);
+   }
+   // Another fault on the page may have been waiting behind the one that
+   // filled it.
+   if (r) {
+      struct uffdio_range page = {(uintptr_t)(m->map + off), pg};
+      (void) ioctl(m->uffd, UFFDIO_WAKE, &page);
+   }
+   for (size_t i = 0; i < 2; ++i) {
+      if (c[i])
+         drop_cached(m, c[i]);
+   }
+}
+
+static void *serve_faults(void *arg) {
+   struct mount *m = arg;
+   struct pollfd p[] = {
+      {.fd = m->uffd, .events = POLLIN},
+      {.fd = m->unmap[0], .events = POLLIN},
+   };
+   for (;;) {
+      if (poll(p, 2, -1) < 0 && errno != EINTR)
+         break;
+      if (p[1].revents)
+         break;
+      struct uffd_msg msg;
+      if (read(m->uffd, &msg, sizeof msg) == sizeof msg
+       && msg.event == UFFD_EVENT_PAGEFAULT)
+      {
+         const uint_fast64_t at = msg.arg.pagefault.address
+                                - (uintptr_t)m->map;
+         fill_fault(m, at / m->page * m->page);
+      }
+   }
+   return NULL;
+}
+
+// For --mount-map: maps the whole plaintext with none of its pages there yet,
+// and starts the thread that fills them as they're touched. Returns the
+// exit status for main.
+static int map_plain(struct mount *m) {
+   m->page = (size_t)sysconf(_SC_PAGESIZE);
+   if (m->size > SIZE_MAX - m->page) {
+      fputs("Input too large to map\n", stderr);
+      return 4;
+   }
+   m->map_len = (size_t)((m->size + m->page - 1) / m->page * m->page);
+   if (!m->map_len)
+      return 0;
+   m->bad = calloc((size_t)(m->nchunks + 7) / 8, 1);
+   m->pins = calloc((size_t)m->nchunks, sizeof *m->pins);
+   m->resident = malloc(m->nresident * sizeof *m->resident);
+   m->fault_box = malloc(BUFLEN);
+   m->fault_page = malloc(m->page);
+   if (!m->bad || !m->pins || !m->resident || !m->fault_box
+    || !m->fault_page)
+   {
+      perror("Couldn't malloc buffers");
+      return 4;
+   }
+   for (size_t i = 0; i < m->nresident; ++i)
+      m->resident[i] = UINT_FAST64_MAX;
+   // Locking the map as it's made would fill it with zeroes, so lock pages
+   // only as they're filled from now on.
+   if (mlockall(MCL_CURRENT | MCL_FUTURE | MCL_ONFAULT)) {
+      perror("Couldn't mlockall");
+      return 5;
+   }
+   m->map = mmap(NULL, m->map_len, PROT_READ,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+   if (m->map == MAP_FAILED) {
+      perror("Couldn't map the plaintext");
+      return 4;
+   }
+
+   // Only faults from user space need handling, since reads touch the pages
+   // before handing them to the kernel. Older kernels can't tell the two
+   // apart.
+   m->uffd = (int)syscall(SYS_userfaultfd,
+                          O_CLOEXEC | O_NONBLOCK | UFFD_USER_MODE_ONLY);
+   if (m->uffd < 0 && errno == EINVAL)
+      m->uffd = (int)syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+   struct uffdio_api api = {.api = UFFD_API};
+   struct uffdio_register reg = {
+      .range = {(uintptr_t)m->map, m->map_len},
+      .mode = UFFDIO_REGISTER_MODE_MISSING,
+   };
+   if (m->uffd < 0 || ioctl(m->uffd, UFFDIO_API, &api)
+    || ioctl(m->uffd, UFFDIO_REGISTER, &reg))
+   {
+      perror("Couldn't set up userfaultfd");
+      return 3;
+   }
+   pthread_attr_t attr;
+   if (!stack_attr(&attr))
+      return 4;
+   if (pipe2(m->unmap, O_CLOEXEC)
+    || (errno = pthread_create(&m->faults, &attr, serve_faults, m)))
+   {
+      perror("Couldn't start thread");
+      return 4;
+   }
+   return 0;
+}
+
+static void unmap_plain(struct mount *m) {
+   if (!m->map)
+      return;
+   (void) write(m->unmap[1], "", 1);
+   pthread_join(m->faults, NULL);
+   munmap(m->map, m->map_len);
+}
+
+// For --mount-map: adds by to the pins of the chunks [off, end) lies in.
+static void pin_map(struct mount *m, uint_fast64_t off, uint_fast64_t end,
+                    size_t by)
+{
+   pthread_mutex_lock(&m->e->lock);
+   for (uint_fast64_t i = off / CHUNKLEN; i <= (end - 1) / CHUNKLEN; ++i)
+      m->pins[i] += by;
+   pthread_mutex_unlock(&m->e->lock);
+}
+
+// For --mount-map: touches the pages of [off, end) so that they're filled.
+// Returns whether all the chunks they're from opened.
+static bool touch_map(struct mount *m, uint_fast64_t off, uint_fast64_t end) {
+   for (uint_fast64_t at = off / m->page * m->page; at < end; at += m->page)
+      (void) *(volatile unsigned char *)(m->map + at);
+   bool ok = true;
+   pthread_mutex_lock(&m->e->lock);
+   for (uint_fast64_t i = off / CHUNKLEN; ok && i <= (end - 1) / CHUNKLEN; ++i)
+      ok = !(m->bad[i / 8] & 1U << i % 8);
+   pthread_mutex_unlock(&m->e->lock);
+   return ok;
+}
+
+// Replies to request unique with error, if not zero, or len octets of arg.
+// If the request was interrupted, the kernel doesn't want the reply anyway.
+static void reply(const struct mount *m, uint64_t unique, int error,
+                  void *arg, size_t len)
+{
+   struct fuse_out_header h = {
+      .len = (uint32_t)(sizeof h + len),
+      .error = -error,
+      .unique = unique,
+   };
+   struct iovec iov[] = {{&h, sizeof h}, {arg, len}};
+   (void) writev(m->fuse, iov, len ? 2 : 1);
+}
+
+static void mount_attr(const struct mount *m, uint64_t node,
+                       struct fuse_attr *a)
+{
+   const bool file = node == MOUNT_FILE_ID;
+   *a = (struct fuse_attr){
+      .ino = node,
+      .size = file ? m->size : 0,
+      .blocks = file ? (m->size + 511) / 512 : 0,
+      .atime = (uint64_t)m->mtime.tv_sec,
+      .mtime = (uint64_t)m->mtime.tv_sec,
+      .ctime = (uint64_t)m->mtime.tv_sec,
+      .atimensec = (uint32_t)m->mtime.tv_nsec,
+      .mtimensec = (uint32_t)m->mtime.tv_nsec,
+      .ctimensec = (uint32_t)m->mtime.tv_nsec,
+      .mode = file ? S_IFREG | 0444 : S_IFDIR | 0555,
+      .nlink = file ? 1 : 2,
+      .uid = getuid(),
+      .gid = getgid(),
+      .blksize = MOUNT_MAX_READ,
+   };
+}
+
+// Replies with the plaintext a read asks for straight from the cache, then
+// if reads look sequential, opens the chunk after it ahead of them.
+static void mount_read(struct mount *m, uint64_t unique,
+                       const struct fuse_read_in *in, unsigned char *box)
+{
+   const uint32_t size = in->size < MOUNT_MAX_READ ? in->size
+                                                   : MOUNT_MAX_READ;
+   const uint_fast64_t off = in->offset < m->size ? in->offset : m->size,
+                       end = m->size - off < size ? m->size : off + size;
+   struct cached *c[MOUNT_READ_CHUNKS] = {NULL};
+   struct fuse_out_header h = {.len = sizeof h, .unique = unique};
+   struct iovec iov[MOUNT_READ_CHUNKS + 1] = {{&h, sizeof h}};
+   int n = 1;
+   // The kernel can't fault the pages in itself, so they mustn't be dropped
+   // between being touched and being written out.
+   if (m->map && off < end) {
+      pin_map(m, off, end, 1);
+      if (touch_map(m, off, end)) {
+         iov[n++] = (struct iovec){m->map + off, (size_t)(end - off)};
+         h.len += (uint32_t)(end - off);
+      } else {
+         h.error = -EIO;
+      }
+   }
+   for (uint_fast64_t at = off; !m->map && at < end; ++n) {
+      const uint_fast64_t idx = at / CHUNKLEN, within = at % CHUNKLEN;
+      const size_t len = (size_t)(end - at < CHUNKLEN - within
+                                  ? end - at : CHUNKLEN - within);
+      if (!(c[n - 1] = get_cached(m, idx, box))) {
+         h.error = -EIO;
+         break;
+      }
+      iov[n] = (struct iovec){
+         c[n - 1]->buf + crypto_secretbox_ZEROBYTES + within, len,
+      };
+      h.len += (uint32_t)len;
+      at += len;
+   }
+   if (h.error) {
+      h.len = sizeof h;
+      n = 1;
+   }
+   (void) writev(m->fuse, iov, n);
+   if (m->map && off < end)
+      pin_map(m, off, end, SIZE_MAX);
+   for (size_t i = 0; i < MOUNT_READ_CHUNKS; ++i) {
+      if (c[i])
+         drop_cached(m, c[i]);
+   }
+   if (h.error || off == end)
+      return;
+
+   const uint_fast64_t first = off / CHUNKLEN, last = (end - 1) / CHUNKLEN;
+   pthread_mutex_lock(&m->e->lock);
+   const bool sequential = first == m->last_read || first == m->last_read + 1;
+   m->last_read = last;
+   pthread_mutex_unlock(&m->e->lock);
+   if (sequential && last + 1 < m->nchunks && m->map) {
+      const uint_fast64_t ahead = ((last + 1) * CHUNKLEN + m->page - 1)
+                                / m->page * m->page;
+      if (ahead < m->size)
+         (void) touch_map(m, ahead, ahead + 1);
+   } else if (sequential && last + 1 < m->nchunks) {
+      struct cached *ahead = get_cached(m, last + 1, box);
+      if (ahead)
+         drop_cached(m, ahead);
+   }
+}
+
+static void mount_readdir(const struct mount *m, uint64_t unique,
+                          const struct fuse_read_in *in)
+{
+   const char *const names[] = {".", "..", m->name};
+   const uint64_t nodes[] = {FUSE_ROOT_ID, FUSE_ROOT_ID, MOUNT_FILE_ID};
+   uint64_t out[(FUSE_NAME_OFFSET + NAME_MAX + 8) / 8 * 3];
+   size_t len = 0;
+   for (uint64_t i = in->offset; i < 3; ++i) {
+      const size_t namelen = strlen(names[i]),
+                   size = FUSE_DIRENT_ALIGN(FUSE_NAME_OFFSET + namelen);
+      if (len + size > in->size)
+         break;
+      struct fuse_dirent *d = (struct fuse_dirent *)((char *)out + len);
+      *d = (struct fuse_dirent){
+         .ino = nodes[i],
+         .off = i + 1,
+         .namelen = (uint32_t)namelen,
+         .type = i < 2 ? DT_DIR : DT_REG,
+      };
+      memcpy(d->name, names[i], namelen);
+      memset(d->name + namelen, 0, size - FUSE_NAME_OFFSET - namelen);
+      len += size;
+   }
+   reply(m, unique, 0, out, len);
+}
+
+// Handles the requests FUSE sends us until it's unmounted. The file and
+// directory never change, so the kernel may cache them for as long as it
+// likes.
+static void *serve_mount(void *arg) {
+   struct mount *m = arg;
+   uint64_t *req = malloc(MOUNT_REQUEST);
+   unsigned char *box = malloc(BUFLEN);
+   if (!req || !box) {
+      perror("Couldn't malloc buffers");
+      free(req);
+      free(box);
+      return NULL;
+   }
+
+   for (;;) {
+      const ssize_t n = read(m->fuse, req, MOUNT_REQUEST);
+      if (n < 0 && (errno == EINTR || errno == EAGAIN || errno == ENOENT))
+         continue;
+      if (n < (ssize_t)sizeof(struct fuse_in_header))
+         break;
+      const struct fuse_in_header *in = (const struct fuse_in_header *)req;
+      const void *body = in + 1;
+      const uint64_t node = in->nodeid;
+
+      switch (in->opcode) {
+      case FUSE_INIT: {
+         const struct fuse_init_in *init = body;
+         struct fuse_init_out out = {
+            .major = FUSE_KERNEL_VERSION,
+            .minor = FUSE_KERNEL_MINOR_VERSION,
+         };
+         if (init->major < 7) {
+            reply(m, in->unique, EPROTO, NULL, 0);
+            break;
+         }
+         if (init->major == 7) {
+            out.max_readahead = init->max_readahead;
+            out.flags = init->flags & (FUSE_ASYNC_READ | FUSE_MAX_PAGES);
+            out.max_write = 4096;
+            const long page = sysconf(_SC_PAGESIZE);
+            out.max_pages = (uint16_t)(page < MOUNT_MAX_READ
+                                       ? MOUNT_MAX_READ / page : 1);
+            out.time_gran = 1;
+         }
+         reply(m, in->unique, 0, &out, init->minor < 23
+                                         ? FUSE_COMPAT_22_INIT_OUT_SIZE
+                                         : sizeof out);
+         break;
+      }
+      case FUSE_LOOKUP: {
+         struct fuse_entry_out out = {
+            .nodeid = MOUNT_FILE_ID,
+            .entry_valid = UINT32_MAX,
+            .attr_valid = UINT32_MAX,
+         };
+         if (node != FUSE_ROOT_ID || strcmp(body, m->name)) {
+            reply(m, in->unique, ENOENT, NULL, 0);
+            break;
+         }
+         mount_attr(m, MOUNT_FILE_ID, &out.attr);
+         reply(m, in->unique, 0, &out, sizeof out);
+         break;
+      }
+      case FUSE_GETATTR: {
+         struct fuse_attr_out out = {.attr_valid = UINT32_MAX};
+         mount_attr(m, node, &out.attr);
+         reply(m, in->unique, 0, &out, sizeof out);
+         break;
+      }
+      case FUSE_OPEN:
+      case FUSE_OPENDIR: {
+         const struct fuse_open_in *open_in = body;
+         struct fuse_open_out out = {
+            .open_flags = in->opcode == FUSE_OPEN ? FOPEN_KEEP_CACHE : 0,
+         };
+         if ((node == MOUNT_FILE_ID) != (in->opcode == FUSE_OPEN))
+            reply(m, in->unique, node == MOUNT_FILE_ID ? ENOTDIR : EISDIR,
+                  NULL, 0);
+         else if ((open_in->flags & O_ACCMODE) != O_RDONLY)
+            reply(m, in->unique, EROFS, NULL, 0);
+         else
+            reply(m, in->unique, 0, &out, sizeof out);
+         break;
+      }
+      case FUSE_READ:
+         mount_read(m, in->unique, body, box);
+         break;
+      case FUSE_READDIR:
+         mount_readdir(m, in->unique, body);
+         break;
+      case FUSE_STATFS: {
+         struct fuse_statfs_out out = {
+            .st = {.bsize = 4096, .frsize = 4096, .namelen = NAME_MAX},
+         };
+         reply(m, in->unique, 0, &out, sizeof out);
+         break;
+      }
+      case FUSE_ACCESS: {
+         const struct fuse_access_in *access_in = body;
+         reply(m, in->unique, access_in->mask & W_OK ? EROFS : 0, NULL, 0);
+         break;
+      }
+      case FUSE_RELEASE:
+      case FUSE_RELEASEDIR:
+      case FUSE_FLUSH:
+      case FUSE_DESTROY:
+         reply(m, in->unique, 0, NULL, 0);
+         break;
+      case FUSE_FORGET:
+      case FUSE_BATCH_FORGET:
+      case FUSE_INTERRUPT:
+         break;
+      default:
+         reply(m, in->unique, ENOSYS, NULL, 0);
+      }
+   }
+   free(req);
+   free(box);
+   return NULL;
+}
+
+// Runs fusermount3 with args, handing it sock, if not negative, to send the
+// FUSE fd over. Returns whether it succeeded.
+static bool fusermount(const char *const *args, int sock) {
+   const pid_t pid = fork();
+   if (!pid) {
+      char fd[16];
+      snprintf(fd, sizeof fd, "%d", sock);
+      if (sock >= 0)
+         setenv("_FUSE_COMMFD", fd, 1);
+      execvp("fusermount3", (char *const *)(uintptr_t)args);
+      _exit(127);
+   }
+   int status;
+   return pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status)
+       && !WEXITSTATUS(status);
+}
+
+// Mounts dir read-only, returning the FUSE fd to serve it on or -1. Without
+// the privilege to, fusermount3 mounts it and hands the fd back over a
+// socket.
+static int mount_fuse(const char *dir) {
+   int fd = open("/dev/fuse", O_RDWR | O_CLOEXEC);
+   if (fd < 0) {
+      perror("Couldn't open /dev/fuse");
+      return -1;
+   }
+   // max_read keeps reads to what mount_read expects.
+   char opts[128];
+   snprintf(opts, sizeof opts,
+            "fd=%d,rootmode=%o,user_id=%u,group_id=%u,max_read=%d", fd,
+            S_IFDIR, getuid(), getgid(), MOUNT_MAX_READ);
+   if (!mount("naclypt", dir, "fuse.naclypt",
+              MS_NOSUID | MS_NODEV | MS_RDONLY, opts))
+      return fd;
+   if (errno != EPERM) {
+      fprintf(stderr, "Couldn't mount %s: %s\n", dir, strerror(errno));
+      close(fd);
+      return -1;
+   }
+   close(fd);
+
+   int sv[2];
+   if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+      perror("Couldn't create socket for fusermount3");
+      return -1;
+   }
+   char fuse_opts[64];
+   snprintf(fuse_opts, sizeof fuse_opts,
+            "ro,nosuid,nodev,subtype=naclypt,max_read=%d", MOUNT_MAX_READ);
+   const char *const args[] = {"fusermount3", "-o", fuse_opts, "--", dir, NULL};
+   const bool ok = fusermount(args, sv[1]);
+   close(sv[1]);
+
+   char cbuf[CMSG_SPACE(sizeof fd)], data;
+   struct iovec iov = {&data, 1};
+   struct msghdr msg = {
+      .msg_iov = &iov,
+      .msg_iovlen = 1,
+      .msg_control = cbuf,
+      .msg_controllen = sizeof cbuf,
+   };
+   const struct cmsghdr *cmsg;
+   fd = -1;
+   if (ok && recvmsg(sv[0], &msg, 0) > 0 && (cmsg = CMSG_FIRSTHDR(&msg))
+    && cmsg->cmsg_type == SCM_RIGHTS)
+      memcpy(&fd, CMSG_DATA(cmsg), sizeof fd);
+   close(sv[0]);
+   if (fd < 0)
+      fprintf(stderr, "Couldn't mount %s with fusermount3\n", dir);
+   return fd;
+}
+
+static void unmount_fuse(const char *dir) {
+   const char *const args[] = {"fusermount3", "-u", "-z", "--", dir, NULL};
+   if (umount2(dir, MNT_DETACH) && (errno != EPERM || !fusermount(args, -1)))
+      fprintf(stderr, "Couldn't unmount %s\n", dir);
+}
+
+// For --mount: serves infile's plaintext as a file in dir, named as infile,
+// on jobs threads until dir is unmounted or SIGINT or SIGTERM comes, which
+// unmount it. With map, the reads are served from map_plain's mapping, and
+// the cache only needs to hold the chunks a page is filled from. Returns the
+// exit status for main.
+static int run_mount(struct engine *e, const char *dir, const char *name,
+                     size_t jobs, size_t ncache, bool map)
+{
+   struct stat st;
+   const off_t data = e->in_end - e->in_base;
+   struct mount m = {
+      .e = e,
+      .name = name,
+      .nchunks = (uint_fast64_t)(data + BUFLEN - 1) / BUFLEN,
+      .last_read = UINT_FAST64_MAX - 1,
+      .ncache = ncache,
+   };
+   const size_t last = m.nchunks ? (size_t)((uint_fast64_t)data
+                                          - (m.nchunks - 1) * BUFLEN) : 0;
+   if (m.nchunks && last <= crypto_secretbox_ZEROBYTES)
+      return truncated((m.nchunks - 1) * CHUNKLEN, last);
+   m.size = (uint_fast64_t)data - m.nchunks * crypto_secretbox_ZEROBYTES;
+   if (!fstat(e->in_fd, &st))
+      m.mtime = st.st_mtim;
+   if (map) {
+      m.nresident = ncache;
+      m.ncache = ncache = 2;
+      const int status = map_plain(&m);
+      if (status)
+         return status;
+   }
+
+   if (!(m.cache = calloc(ncache, sizeof *m.cache))) {
+      perror("Couldn't malloc the cache");
+      return 4;
+   }
+   for (size_t i = 0; i < ncache; ++i) {
+      if (!(m.cache[i].buf = malloc(BUFLEN))) {
+         perror("Couldn't malloc the cache");
+         return 4;
+      }
+   }
+
+   catch_stop();
+   if ((m.fuse = mount_fuse(dir)) < 0)
+      return 1;
+   pthread_attr_t attr;
+   pthread_t *threads = stack_attr(&attr) ? malloc(jobs * sizeof *threads)
+                                          : NULL;
+   size_t started = 0;
+   while (threads && started < jobs
+       && !(errno = pthread_create(&threads[started], &attr, serve_mount, &m)))
+      ++started;
+   if (!started) {
+      perror("Couldn't start threads");
+      unmount_fuse(dir);
+      unmap_plain(&m);
+      return 4;
+   }
+   if (e->verbose)
+      fprintf(stderr, "Serving %s/%s on %zu threads\n", dir, name, started);
+
+   // Once unmounted, the FUSE fd polls as an error.
+   sigset_t mask;
+   pthread_sigmask(SIG_SETMASK, NULL, &mask);
+   sigdelset(&mask, SIGINT);
+   sigdelset(&mask, SIGTERM);
+   struct pollfd p = {.fd = m.fuse};
+   while (!stopping && ppoll(&p, 1, NULL, &mask) <= 0)
+      ;
+   if (stopping)
+      unmount_fuse(dir);
+   for (size_t i = 0; i < started; ++i)
+      pthread_join(threads[i], NULL);
+   unmap_plain(&m);
+   return 0;
+}
+
+// For --connect: connects to to, HOST:PORT, over TCP, returning the socket or
+// -1. An IPv6 HOST may be in brackets.
+static int connect_tcp(const char *to) {
+   char host[256];
+   const char *colon = strrchr(to, ':');
+   size_t len = (size_t)(colon - to);
+   if (len >= sizeof host) {
+      fprintf(stderr, "Host name too long: %s\n", to);
+      return -1;
+   }
+   memcpy(host, to, len);
+   host[len] = 0;
+   if (len >= 2 && host[0] == '[' && host[len - 1] == ']') {
+      memmove(host, host + 1, len - 2);
+      host[len - 2] = 0;
+   }
+
+   struct addrinfo hints = {.ai_socktype = SOCK_STREAM}, *ai;
+   const int err = getaddrinfo(host, colon + 1, &hints, &ai);
+   if (err) {
+      fprintf(stderr, "Couldn't resolve %s: %s\n", to, gai_strerror(err));
+      return -1;
+   }
+   int sock = -1;
+   for (const struct addrinfo *a = ai; a && sock < 0; a = a->ai_next) {
+      sock = socket(a->ai_family, a->ai_socktype | SOCK_CLOEXEC,
+                    a->ai_protocol);
+      if (sock >= 0 && connect(sock, a->ai_addr, a->ai_addrlen)) {
+         close(sock);
+         sock = -1;
+      }
+   }
+   freeaddrinfo(ai);
+   if (sock < 0)
+      fprintf(stderr, "Couldn't connect to %s: %s\n", to, strerror(errno));
+   return sock;
+}
+
+// For --send: connects to the Unix socket at path, returning it or -1.
+static int connect_send(const char *path) {
+   struct sockaddr_un addr = {.sun_family = AF_UNIX};
+   if (strlen(path) >= sizeof addr.sun_path) {
+      fprintf(stderr, "Socket path too long: %s\n", path);
+      return -1;
+   }
+   strcpy(addr.sun_path, path);
+   const int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+   if (sock < 0 || connect(sock, (struct sockaddr *)&addr, sizeof addr)) {
+      fprintf(stderr, "Couldn't connect to %s: %s\n", path, strerror(errno));
+      if (sock >= 0)
+         close(sock);
+      return -1;
+   }
+   return sock;
+}
+
+// For --send: seals the memfd on stdout against any change and passes it
+// over sock, along with its length as an 8-octet big-endian integer. Returns
+// the exit status for main.
+static int send_output(int sock) {
+   struct stat st;
+   if (fflush(stdout) || fstat(STDOUT_FILENO, &st)
+    || fcntl(STDOUT_FILENO, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW
+                                        | F_SEAL_WRITE | F_SEAL_SEAL))
+   {
+      perror("Couldn't seal output");
+      return 1;
+   }
+   unsigned char len[8];
+   put_be64(len, (uint_fast64_t)st.st_size);
+
+   const int fd = STDOUT_FILENO;
+   char cbuf[CMSG_SPACE(sizeof fd)];
+   struct iovec iov = {len, sizeof len};
+   struct msghdr msg = {
+      .msg_iov = &iov,
+      .msg_iovlen = 1,
+      .msg_control = cbuf,
+      .msg_controllen = sizeof cbuf,
+   };
+   struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+   cmsg->cmsg_level = SOL_SOCKET;
+   cmsg->cmsg_type = SCM_RIGHTS;
+   cmsg->cmsg_len = CMSG_LEN(sizeof fd);
+   memcpy(CMSG_DATA(cmsg), &fd, sizeof fd);
+   if (sendmsg(sock, &msg, MSG_NOSIGNAL) != sizeof len) {
+      perror("Couldn't send output");
+      return 1;
+   }
+   return 0;
+}
+
+// The magic, before any format flags are XORed into its last octet.
+static void make_magic(unsigned char *magic) {
+   memcpy(magic, crypto_secretbox_PRIMITIVE, sizeof crypto_secretbox_PRIMITIVE);
+
+   // Obfuscate it a bit.
+   for (size_t i = 0; i < sizeof crypto_secretbox_PRIMITIVE; ++i)
+      magic[i] ^= (uint8_t)(0xeeU + (i << 5));
+}
+
+// For --transcode: reads the header of input, an encrypted file, leaving its
+// format flags in flags, and stretches password with its argon2 parameters
+// and salt into key, clearing password if clear is set. Returns the exit
+// status for main.
+static int old_key(FILE *input, uint8_t *password, uint32_t pwlen, bool clear,
+                   size_t cpus, unsigned char *key, unsigned *flags)
+{
+   const size_t m = sizeof crypto_secretbox_PRIMITIVE;
+   unsigned char magic[sizeof crypto_secretbox_PRIMITIVE], h[HEADERLEN];
+   make_magic(magic);
+   if (read_full(input, h, sizeof h) != sizeof h) {
+      fputs("Invalid input: couldn't read header\n", stderr);
+      return 1;
+   }
+   if (memcmp(h, magic, m - 1)) {
+      fputs("Invalid input: bad magic (maybe bad libsodium)\n", stderr);
+      return 1;
+   }
+   if ((*flags = h[m - 1] ^ magic[m - 1]) & ~KNOWN_FLAGS) {
+      fprintf(stderr, "Invalid input: unknown format flags %#x (maybe from a "
+                      "newer version)\n", *flags);
+      return 1;
+   }
+
+   // Framed chunks and --store manifests don't line up with those of the
+   // output.
+   if (*flags & (FLAG_FRAMED | FLAG_STORE)) {
+      fputs("Can't transcode the input: it's framed or a --store "
+            "manifest\n", stderr);
+      return 1;
+   }
+
+   const uint8_t logm = h[m];
+   uint32_t t = 0, p = 0;
+   for (size_t i = 0; i < 4; ++i) {
+      t = t << 8 | h[m + 1 + i];
+      p = p << 8 | h[m + 5 + i];
+   }
+   if (logm < 2 || logm >= 32 || !t || !p || p >= 1ul << 24u
+    || (uint64_t)1 << logm < (uint64_t)p * 8)
+   {
+      fputs("Invalid input: bad argon2 parameters\n", stderr);
+      return 1;
+   }
+
+   argon2_context ctx = {
+      .out = key,
+      .outlen = crypto_secretbox_KEYBYTES,
+      .pwd = password,
+      .pwdlen = pwlen,
+      .salt = h + m + 9,
+      .saltlen = crypto_secretbox_KEYBYTES,
+      .t_cost = t,
+      .m_cost = (uint32_t)1 << logm,
+      .lanes = p,
+      .threads = p < cpus ? p : (uint32_t)cpus,
+      .version = ARGON2_VERSION_13,
+      .flags = clear ? ARGON2_FLAG_CLEAR_PASSWORD : 0,
+   };
+   const int status = argon2i_ctx(&ctx);
+   if (status != ARGON2_OK) {
+      fprintf(stderr, "argon2i failed: %s\n", argon2_error_message(status));
+      return 6;
+   }
+   return 0;
+}
+
+int main(int argc, char **argv) {
+   if (mlockall(MCL_CURRENT | MCL_FUTURE)) {
+      perror("Couldn't mlockall");
+      return 5;
+   }
+
+   bool decrypting = false, usage = false, numa = false, verbose = false,
+        drop_cache = false, resuming = false, appending = false,
+        following = false, merkle = false, deterministic = false,
+        from_volumes = false, transcode = false, mount_map = false;
+   unsigned long jobs = 0, depth = 0;
+   uint_fast64_t first_chunk = 0, end_chunk = UINT_FAST64_MAX,
+                 checkpoint_every = CHECKPOINT_EVERY;
+   const char *salt_from = NULL, *output = NULL, *checkpoint = NULL,
+              *digest_file = NULL, *store = NULL, *patch = NULL,
+              *old_password = NULL, *mount_dir = NULL, *shared_cache = NULL,
+              *send_to = NULL, *connect_to = NULL;
+   int plain_digest = DIGEST_NONE, cipher_digest = DIGEST_NONE;
+   double read_rate = 0, write_rate = 0;
+   int ioprio = -1;
+   double flush_after = FLUSH_AFTER, follow_timeout = FOLLOW_TIMEOUT;
+   int records = RECORDS_NONE;
+   struct tee tees[MAX_TEES];
+   size_t ntees = 0;
+   unsigned long tee_lag = TEE_LAG;
+   long long follow_size = -1, show_tree = -1;
+   unsigned long flush_size = CHUNKLEN;
+   unsigned long long volume_size = 0;
+   const char *volume_dirs[MAX_VOLUME_DIRS];
+   size_t nvolume_dirs = 0;
+   unsigned long mount_cache = MOUNT_CACHE, shared_cache_size = SHARED_CACHE;
+
+   enum {
+      OPT_APPEND = 256, OPT_CHECKPOINT, OPT_CHECKPOINT_EVERY, OPT_CHUNK_RANGE,
+      OPT_CIPHER_DIGEST, OPT_CONNECT, OPT_DETERMINISTIC, OPT_DIGEST_FILE,
+      OPT_DROP_CACHE, OPT_FLUSH_AFTER, OPT_FLUSH_SIZE, OPT_FOLLOW,
+      OPT_FOLLOW_SIZE, OPT_FOLLOW_TIMEOUT, OPT_IOPRIO, OPT_MERKLE, OPT_MOUNT,
+      OPT_MOUNT_CACHE, OPT_MOUNT_MAP, OPT_NUMA, OPT_OLD_PASSWORD, OPT_PATCH,
+      OPT_PLAIN_DIGEST, OPT_READ_RATE, OPT_RECORDS, OPT_RESUME, OPT_SALT_FROM,
+      OPT_SEND, OPT_SHARED_CACHE, OPT_SHARED_CACHE_SIZE, OPT_SHOW_TREE,
+      OPT_STORE, OPT_TEE, OPT_TEE_LAG, OPT_TRANSCODE, OPT_VOLUME_DIR,
+      OPT_VOLUME_SIZE, OPT_VOLUMES, OPT_WRITE_RATE,
+   };
+   static const struct option options[] = {
+      {"append",           no_argument,       NULL, OPT_APPEND},
+      {"checkpoint",       required_argument, NULL, OPT_CHECKPOINT},
+      {"checkpoint-every", required_argument, NULL, OPT_CHECKPOINT_EVERY},
+      {"chunk-range",      required_argument, NULL, OPT_CHUNK_RANGE},
+      {"cipher-digest",    required_argument, NULL, OPT_CIPHER_DIGEST},
+      {"connect",          required_argument, NULL, OPT_CONNECT},
+      {"decrypt",          no_argument,       NULL, 'd'},
+      {"depth",            required_argument, NULL, 'q'},
+      {"deterministic",    no_argument,       NULL, OPT_DETERMINISTIC},
+      {"digest-file",      required_argument, NULL, OPT_DIGEST_FILE},
+      {"drop-cache",       no_argument,       NULL, OPT_DROP_CACHE},
+      {"flush-after",      required_argument, NULL, OPT_FLUSH_AFTER},
+      {"flush-size",       required_argument, NULL, OPT_FLUSH_SIZE},
+      {"follow",           no_argument,       NULL, OPT_FOLLOW},
+      {"follow-size",      required_argument, NULL, OPT_FOLLOW_SIZE},
+      {"follow-timeout",   required_argument, NULL, OPT_FOLLOW_TIMEOUT},
+      {"ioprio",           required_argument, NULL, OPT_IOPRIO},
+      {"jobs",             required_argument, NULL, 'j'},
+      {"merkle",           no_argument,       NULL, OPT_MERKLE},
+      {"mount",            required_argument, NULL, OPT_MOUNT},
+      {"mount-map",        no_argument,       NULL, OPT_MOUNT_MAP},
+      {"mount-cache",      required_argument, NULL, OPT_MOUNT_CACHE},
+      {"numa",             no_argument,       NULL, OPT_NUMA},
+      {"old-password",     required_argument, NULL, OPT_OLD_PASSWORD},
+      {"output",           required_argument, NULL, 'o'},
+      {"patch",            required_argument, NULL, OPT_PATCH},
+      {"plain-digest",     required_argument, NULL, OPT_PLAIN_DIGEST},
+      {"read-rate",        required_argument, NULL, OPT_READ_RATE},
+      {"records",          required_argument, NULL, OPT_RECORDS},
+      {"resume",           no_argument,       NULL, OPT_RESUME},
+      {"salt-from",        required_argument, NULL, OPT_SALT_FROM},
+      {"send",             required_argument, NULL, OPT_SEND},
+      {"shared-cache",     required_argument, NULL, OPT_SHARED_CACHE},
+      {"shared-cache-size", required_argument, NULL, OPT_SHARED_CACHE_SIZE},
+      {"show-tree",        required_argument, NULL, OPT_SHOW_TREE},
+      {"store",            required_argument, NULL, OPT_STORE},
+      {"tee",              required_argument, NULL, OPT_TEE},
+      {"tee-lag",          required_argument, NULL, OPT_TEE_LAG},
+      {"transcode",        no_argument,       NULL, OPT_TRANSCODE},
+      {"verbose",          no_argument,       NULL, 'v'},
+      {"volume-dir",       required_argument, NULL, OPT_VOLUME_DIR},
+      {"volume-size",      required_argument, NULL, OPT_VOLUME_SIZE},
+      {"volumes",          no_argument,       NULL, OPT_VOLUMES},
+      {"write-rate",       required_argument, NULL, OPT_WRITE_RATE},
+      {NULL, 0, NULL, 0},
+   };
+   for (int opt;
+        (opt = getopt_long(argc, argv, "dj:o:q:v", options, NULL)) != -1;)
+   {
+      char *end, *colon;
+      switch (opt) {
+      case 'd':
+         decrypting = true;
+         break;
+      case 'j':
+         jobs = strtoul(optarg, &end, 10);
+         if (*end || !*optarg || !jobs || jobs > MAX_JOBS) {
+            fprintf(stderr, "Invalid jobs: should be a decimal integer in the "
+                            "range [1, %d]\n", MAX_JOBS);
+            return 2;
+         }
+         break;
+      case 'o':
+         output = optarg;
+         break;
+      case 'q':
+         depth = strtoul(optarg, &end, 10);
+         if (*end || !*optarg || !depth || depth > MAX_JOBS) {
+            fprintf(stderr, "Invalid depth: should be a decimal integer in "
+                            "the range [1, %d]\n", MAX_JOBS);
+            return 2;
+         }
+         break;
+      case OPT_APPEND:
+         appending = true;
+         break;
+      case OPT_CHECKPOINT:
+         checkpoint = optarg;
+         break;
+      case OPT_CHECKPOINT_EVERY:
+         checkpoint_every = strtoull(optarg, &end, 10);
+         if (*end || !*optarg || !checkpoint_every) {
+            fputs("Invalid checkpoint interval: should be a positive decimal "
+                  "integer\n", stderr);
+            return 2;
+         }
+         break;
+      case OPT_CHUNK_RANGE:
+         first_chunk = strtoull(optarg, &colon, 10);
+         if (*colon == ':' && colon[1])
+            end_chunk = strtoull(colon + 1, &end, 10);
+         else
+            end = colon + (*colon == ':');
+         if (*colon != ':' || colon == optarg || *end
+          || end_chunk < first_chunk)
+         {
+            fputs("Invalid chunk range: should be A:B or A: with decimal "
+                  "integers A <= B\n", stderr);
+            return 2;
+         }
+         break;
+      case OPT_CIPHER_DIGEST:
+      case OPT_PLAIN_DIGEST: {
+         int alg = DIGEST_NONE;
+         for (int i = DIGEST_BLAKE2B; i <= DIGEST_SHA256; ++i) {
+            if (!strcmp(optarg, digest_names[i]))
+               alg = i;
+         }
+         if (!alg) {
+            fputs("Invalid digest: should be blake2b or sha256\n", stderr);
+            return 2;
+         }
+         *(opt == OPT_PLAIN_DIGEST ? &plain_digest : &cipher_digest) = alg;
+         break;
+      }
+      case OPT_CONNECT:
+         connect_to = optarg;
+         if (!strrchr(optarg, ':')) {
+            fputs("Invalid address: should be HOST:PORT\n", stderr);
+            return 2;
+         }
+         break;
+      case OPT_DETERMINISTIC:
+         deterministic = true;
+         break;
+      case OPT_DIGEST_FILE:
+         digest_file = optarg;
+         break;
+      case OPT_DROP_CACHE:
+         drop_cache = true;
+         break;
+      case OPT_FLUSH_AFTER:
+         flush_after = strtod(optarg, &end);
+         if (*end || !*optarg || !(flush_after > 0) || flush_after > 1e9) {
+            fputs("Invalid flush interval: should be a positive number of "
+                  "seconds\n", stderr);
+            return 2;
+         }
+         break;
+      case OPT_FLUSH_SIZE:
+         flush_size = strtoul(optarg, &end, 10);
+         if (*end || !*optarg || !flush_size || flush_size > CHUNKLEN) {
+            fprintf(stderr, "Invalid flush size: should be a decimal integer "
+                            "in the range [1, %d]\n", CHUNKLEN);
+            return 2;
+         }
+         break;
+      case OPT_FOLLOW:
+         following = true;
+         break;
+      case OPT_FOLLOW_SIZE:
+         follow_size = strtoll(optarg, &end, 10);
+         if (*end || !*optarg || follow_size < 0) {
+            fputs("Invalid follow size: should be a decimal integer\n",
+                  stderr);
+            return 2;
+         }
+         break;
+      case OPT_FOLLOW_TIMEOUT:
+         follow_timeout = strtod(optarg, &end);
+         if (*end || !*optarg || !(follow_timeout > 0)
+          || follow_timeout > 1e9)
+         {
+            fputs("Invalid follow timeout: should be a positive number of "
+                  "seconds\n", stderr);
+            return 2;
+         }
+         break;
+      case OPT_IOPRIO: {
+         static const char *const classes[] = {
+            [IOPRIO_CLASS_RT] = "rt",
+            [IOPRIO_CLASS_BE] = "be",
+            [IOPRIO_CLASS_IDLE] = "idle",
+         };
+         const size_t len = strcspn(optarg, ":");
+         unsigned long level = IOPRIO_NORM;
+         int class = 0;
+         for (int i = IOPRIO_CLASS_RT; i <= IOPRIO_CLASS_IDLE; ++i) {
+            if (strlen(classes[i]) == len && !strncmp(optarg, classes[i], len))
+               class = i;
+         }
+         if (optarg[len]) {
+            level = strtoul(optarg + len + 1, &end, 10);
+            if (*end || !optarg[len + 1])
+               class = 0;
+         }
+         if (!class || level >= IOPRIO_NR_LEVELS
+          || (class == IOPRIO_CLASS_IDLE && optarg[len]))
+         {
+            fputs("Invalid ioprio: should be idle, be[:level], or "
+                  "rt[:level], with level in [0, 7]\n", stderr);
+            return 2;
+         }
+         ioprio = IOPRIO_PRIO_VALUE(class, level);
+         break;
+      }
+      case OPT_MERKLE:
+         merkle = true;
+         break;
+      case OPT_MOUNT:
+         mount_dir = optarg;
+         break;
+      case OPT_MOUNT_CACHE:
+         mount_cache = strtoul(optarg, &end, 10);
+         if (*end || !*optarg || !mount_cache || mount_cache > MAX_JOBS) {
+            fprintf(stderr, "Invalid mount cache: should be a decimal integer "
+                            "in the range [1, %d]\n", MAX_JOBS);
+            return 2;
+         }
+         break;
+      case OPT_MOUNT_MAP:
+         mount_map = true;
+         break;
+      case OPT_NUMA:
+         numa = true;
+         break;
+      case OPT_OLD_PASSWORD:
+         old_password = optarg;
          break;
+      case OPT_PATCH:
+         patch = optarg;
+         break;
+      case OPT_READ_RATE:
+      case OPT_WRITE_RATE: {
+         const double rate = strtod(optarg, &end);
+         if (*end || !*optarg || !(rate > 0)) {
+            fputs("Invalid rate: should be a positive number of MB/s\n",
+                  stderr);
+            return 2;
+         }
+         *(opt == OPT_READ_RATE ? &read_rate : &write_rate) = rate;
+         break;
+      }
+      case OPT_RECORDS:
+         records = !strcmp(optarg, "lines")   ? RECORDS_LINES
+                 : !strcmp(optarg, "lengths") ? RECORDS_LENGTHS
+                 : RECORDS_NONE;
+         if (!records) {
+            fputs("Invalid records: should be lines or lengths\n", stderr);
+            return 2;
+         }
+         break;
+      case OPT_RESUME:
+         resuming = true;
+         break;
+      case OPT_SALT_FROM:
+         salt_from = optarg;
+         break;
+      case OPT_SEND:
+         send_to = optarg;
+         break;
+      case OPT_SHARED_CACHE:
+         shared_cache = optarg;
+         break;
+      case OPT_SHARED_CACHE_SIZE:
+         shared_cache_size = strtoul(optarg, &end, 10);
+         if (*end || !*optarg || !shared_cache_size
+          || shared_cache_size > MAX_JOBS)
+         {
+            fprintf(stderr, "Invalid shared cache size: should be a decimal "
+                            "integer in the range\n[1, %d]\n", MAX_JOBS);
+            return 2;
+         }
+         break;
+      case OPT_STORE:
+         store = optarg;
+         break;
+      case OPT_SHOW_TREE:
+         show_tree = strtoll(optarg, &end, 10);
+         if (*end || !*optarg || show_tree < 0) {
+            fputs("Invalid tree depth: should be a non-negative decimal "
+                  "integer\n", stderr);
+            return 2;
+         }
+         break;
+      case OPT_TEE:
+         if (ntees == MAX_TEES) {
+            fprintf(stderr, "Too many --tee: at most %d\n", MAX_TEES);
+            return 2;
+         }
+         tees[ntees++].name = optarg;
+         break;
+      case OPT_TEE_LAG:
+         tee_lag = strtoul(optarg, &end, 10);
+         if (*end || !*optarg || tee_lag > MAX_JOBS) {
+            fprintf(stderr, "Invalid tee lag: should be a decimal integer in "
+                            "the range [0, %d]\n", MAX_JOBS);
+            return 2;
+         }
+         break;
+      case OPT_TRANSCODE:
+         transcode = true;
+         break;
+      case OPT_VOLUME_DIR:
+         if (nvolume_dirs == MAX_VOLUME_DIRS) {
+            fprintf(stderr, "Too many --volume-dir: at most %d\n",
+                    MAX_VOLUME_DIRS);
+            return 2;
+         }
+         volume_dirs[nvolume_dirs++] = optarg;
+         break;
+      case OPT_VOLUME_SIZE:
+         volume_size = strtoull(optarg, &end, 10);
+         if (*end || !*optarg || volume_size < HEADERLEN + BUFLEN) {
+            fprintf(stderr, "Invalid volume size: should be a decimal number "
+                            "of octets, at least %zu\n", HEADERLEN + BUFLEN);
+            return 2;
+         }
+         break;
+      case OPT_VOLUMES:
+         from_volumes = true;
+         break;
+      case 'v':
+         verbose = true;
+         break;
+      default:
+         usage = true;
+      }
    }
-   return w;
-}
+   char **args = argv + optind;
+   const int nargs = argc - optind;
 
-static void __attribute__ ((cold))
-   fill_in_nonce(unsigned char *nonce, uint_fast64_t total_read)
-{
-   uint_fast64_t n = total_read;
-   ssize_t missing = (ssize_t)crypto_secretbox_NONCEBYTES
-                   - (ssize_t)crypto_secretbox_BOXZEROBYTES;
-   for (size_t i = 0; i < sizeof n && missing > 0; --missing, ++i) {
-      nonce[crypto_secretbox_BOXZEROBYTES + i] = (uint8_t)n;
-      n >>= 8;
+   if (decrypting && salt_from) {
+      fputs("--salt-from is only for encrypting\n", stderr);
+      return 2;
+   }
+   if (merkle && (decrypting || following || records || checkpoint
+                  || appending || first_chunk || end_chunk != UINT_FAST64_MAX))
+   {
+      fputs("--merkle is only for encrypting a whole file, and not with "
+            "--follow, --records,\n--checkpoint, or --append\n", stderr);
+      return 2;
+   }
+   if (deterministic && (decrypting || following || records)) {
+      fputs("--deterministic is only for encrypting, and not with --follow "
+            "or --records\n", stderr);
+      return 2;
+   }
+   if (store && (following || records || checkpoint || appending || merkle
+                 || deterministic || cipher_digest || first_chunk
+                 || end_chunk != UINT_FAST64_MAX || show_tree >= 0))
+   {
+      fputs("--store can't be used with --follow, --records, --checkpoint, "
+            "--append, --merkle,\n--deterministic, --cipher-digest, "
+            "--chunk-range, or --show-tree\n", stderr);
+      return 2;
    }
-}
 
-int main(int argc, char **argv) {
-   if (mlockall(MCL_CURRENT | MCL_FUTURE)) {
-      perror("Couldn't mlockall");
-      return 5;
+   // Chunks are only shared between outputs under the same key, so all
+   // outputs into a store take their salt from the header the first one
+   // left there.
+   char store_header[PATH_MAX];
+   if (store) {
+      snprintf(store_header, sizeof store_header, "%s/header", store);
+      if (!decrypting && !salt_from && !access(store_header, F_OK))
+         salt_from = store_header;
    }
+   // The same command can be run again on a store, so logM, t, and p may
+   // still be given then, if they match the header's.
+   const bool check_args = store && salt_from == store_header && nargs == 4;
 
-   const bool decrypting = argc == 3 && !strcmp(argv[2], "-d");
+   if (patch && (decrypting || following || records || checkpoint || appending
+                 || merkle || store || ntees || plain_digest || cipher_digest
+                 || first_chunk || end_chunk != UINT_FAST64_MAX))
+   {
+      fputs("--patch can't be used with -d, --follow, --records, "
+            "--checkpoint, --append,\n--merkle, --store, --tee, the "
+            "digests, or --chunk-range\n", stderr);
+      return 2;
+   }
+   if (volume_size && (decrypting || !output)) {
+      fputs("--volume-size is only for encrypting, with -o naming the "
+            "volumes\n", stderr);
+      return 2;
+   }
+   if (from_volumes && !decrypting) {
+      fputs("--volumes is only for -d\n", stderr);
+      return 2;
+   }
+   if (nvolume_dirs && !volume_size && !from_volumes) {
+      fputs("--volume-dir needs --volume-size or --volumes\n", stderr);
+      return 2;
+   }
+   if ((volume_size || from_volumes)
+    && (following || records || checkpoint || appending || merkle || store
+     || drop_cache || first_chunk || end_chunk != UINT_FAST64_MAX))
+   {
+      fputs("Volumes can't be used with --follow, --records, --checkpoint, "
+            "--append, --merkle,\n--store, --drop-cache, or --chunk-range\n",
+            stderr);
+      return 2;
+   }
+   if (transcode && (decrypting || following || records || checkpoint
+                     || appending || patch || store || deterministic
+                     || first_chunk || end_chunk != UINT_FAST64_MAX))
+   {
+      fputs("--transcode can't be used with -d, --follow, --records, "
+            "--checkpoint, --append,\n--patch, --store, --deterministic, or "
+            "--chunk-range\n", stderr);
+      return 2;
+   }
+   if (mount_dir && (!decrypting || output || ntees || following || store
+                     || from_volumes || plain_digest || cipher_digest
+                     || show_tree >= 0 || first_chunk
+                     || end_chunk != UINT_FAST64_MAX))
+   {
+      fputs("--mount is only for -d, and not with -o, --tee, --follow, "
+            "--store, --volumes,\nthe digests, --show-tree, or "
+            "--chunk-range\n", stderr);
+      return 2;
+   }
+   if (shared_cache && !decrypting && !transcode) {
+      fputs("--shared-cache is only for -d and --transcode\n", stderr);
+      return 2;
+   }
+   if ((send_to || connect_to)
+    && (output || volume_size || resuming || appending || patch || checkpoint
+     || mount_dir || (send_to && connect_to)))
+   {
+      fputs("--send and --connect can't be used with each other, -o, "
+            "--volume-size, --resume,\n--append, --patch, --checkpoint, or "
+            "--mount\n", stderr);
+      return 2;
+   }
+   // The memfd can't be mlocked short of mapping all of it, so it's no place
+   // for plaintext.
+   if (send_to && decrypting) {
+      fputs("--send is only for encrypting\n", stderr);
+      return 2;
+   }
+   if (mount_map && !mount_dir) {
+      fputs("--mount-map is only for --mount\n", stderr);
+      return 2;
+   }
+   if (old_password && !transcode) {
+      fputs("--old-password is only for --transcode\n", stderr);
+      return 2;
+   }
+   if (show_tree >= 0 && !merkle && !decrypting) {
+      fputs("--show-tree needs --merkle, or -d\n", stderr);
+      return 2;
+   }
+   if ((following || records) && (checkpoint || appending || first_chunk
+                                  || end_chunk != UINT_FAST64_MAX))
+   {
+      fputs("--follow and --records can't be used with --checkpoint, "
+            "--append, or\n--chunk-range\n", stderr);
+      return 2;
+   }
+   if (records && (decrypting || following)) {
+      fputs("--records is only for encrypting, and not with --follow (-d "
+            "needs nothing\nspecial to decrypt it)\n", stderr);
+      return 2;
+   }
+   if (ntees && (checkpoint || appending)) {
+      fputs("--tee can't be used with --checkpoint or --append\n", stderr);
+      return 2;
+   }
+   if (checkpoint && (decrypting || first_chunk || end_chunk != UINT_FAST64_MAX))
+   {
+      fputs("--checkpoint is only for encrypting a whole file\n", stderr);
+      return 2;
+   }
+   if (resuming || appending || patch) {
+      if (resuming ? !checkpoint : checkpoint || decrypting || first_chunk
+                                  || end_chunk != UINT_FAST64_MAX)
+      {
+         fputs("--resume needs --checkpoint, and --append can't be used with "
+               "it, -d, or\n--chunk-range\n", stderr);
+         return 2;
+      }
+      if (!output || salt_from) {
+         fputs("--resume, --append, and --patch need -o, and take the salt "
+               "from the output\n", stderr);
+         return 2;
+      }
+      salt_from = output;
+   }
 
-   if (!decrypting && argc != 5) {
+   if (usage || (nargs != (decrypting || salt_from ? 1 : 4) && !check_args)) {
       const char *prog = argc ? argv[0] : "naclypt";
       fprintf(stderr,
-              "Usage: %s infile logM t p\n"
-              "       %s infile -d\n"
+              "Usage: %s [options] infile logM t p\n"
+              "       %s [options] --salt-from=file infile\n"
+              "       %s [options] -o outfile --checkpoint=file --resume "
+              "infile\n"
+              "       %s [options] -o outfile --append infile\n"
+              "       %s [options] -o outfile --patch=list infile\n"
+              "       %s [options] --transcode infile logM t p\n"
+              "       %s [options] infile -d\n"
               "\n"
               "Encrypts (with -d, decrypts) data from infile to stdout using "
               "a password given\non stdin. Does authenticated encryption i.e. "
@@ -81,12 +4496,252 @@ int main(int argc, char **argv) {
               "\n"
               "The password is stretched using argon2(2^logM,t,p). The "
               "decryptor's output\nwill be all zeroes if the wrong password "
-              "is given.\n",
-              prog, prog);
+              "is given.\n"
+              "\n"
+              "Options:\n"
+              "  -j, --jobs=N  Seal or open chunks on N threads (default: as "
+              "many CPUs as our\n"
+              "                affinity mask and cgroup CPU quota allow, up "
+              "to %d, and to as many\n"
+              "                as RLIMIT_MEMLOCK has room to mlock 32 MiB "
+              "for). If stdout is a\n"
+              "                regular file, each thread writes its chunks "
+              "straight into place.\n"
+              "  -q, --depth=N If infile is a regular file or block device, "
+              "keep N reads of it\n"
+              "                in flight at once (default: as many as jobs).\n"
+              "  -o, --output=FILE\n"
+              "                Write to FILE instead of stdout.\n"
+              "  -v, --verbose Report how the work was placed.\n"
+              "  --chunk-range=A:B\n"
+              "                Encrypt only chunks A (inclusive) to B "
+              "(exclusive; if omitted, the\n"
+              "                end) of infile, writing the header only if A is "
+              "zero. Given the\n"
+              "                same salt, the outputs of consecutive ranges "
+              "concatenated form a\n"
+              "                whole encrypted file. With -d, decrypt (and so "
+              "verify) only those\n"
+              "                chunks.\n"
+              "  --salt-from=file\n"
+              "                Reuse logM, t, p, and the salt from the header "
+              "of file, an earlier\n"
+              "                output, instead of generating a new salt.\n"
+              "  --deterministic\n"
+              "                Derive each chunk's nonce from a keyed hash of "
+              "its plaintext and\n"
+              "                place, rather than from /dev/urandom. Given the "
+              "same password and\n"
+              "                --salt-from the previous output, unchanged "
+              "chunks then come out\n"
+              "                the same, for rsync and deduplication to skip, "
+              "but so does\n"
+              "                whether a chunk changed show.\n"
+              "  --numa        Spread workers and readers over the NUMA "
+              "nodes we may run on,\n"
+              "                binding each to its node and giving it buffers "
+              "there, and\n"
+              "                interleave argon2's memory over them.\n"
+              "  --read-rate=R, --write-rate=R\n"
+              "                Read infile or write stdout at no more than R "
+              "MB/s.\n"
+              "  --ioprio=C    Do I/O in the scheduling class C: idle, "
+              "be[:level], or\n"
+              "                rt[:level], as with ionice.\n"
+              "  --drop-cache  If stdout is a regular file, write it back "
+              "as we go, and keep\n"
+              "                neither it nor infile in the page cache.\n"
+              "  --checkpoint=FILE\n"
+              "                Every N chunks, sync stdout, which must be a "
+              "regular file, and\n"
+              "                record in FILE how far it got. FILE is removed "
+              "once done.\n"
+              "  --checkpoint-every=N\n"
+              "                (default: %d, about a GiB.)\n",
+              prog, prog, prog, prog, prog, prog, prog, DEFAULT_JOBS,
+              CHECKPOINT_EVERY);
+      fprintf(stderr,
+              "  --resume      Pick up where the run that left the "
+              "--checkpoint stopped,\n"
+              "                after checking that the output so far matches "
+              "infile. The\n"
+              "                password must be given again.\n"
+              "  --append      Add infile to the end of the existing "
+              "encrypted outfile,\n"
+              "                sealing its partial last chunk again along with "
+              "what follows.\n"
+              "                outfile needs at least one chunk, to check the "
+              "password with.\n"
+              "  --patch=LIST  Seal again, in place in the existing encrypted "
+              "outfile, just the\n"
+              "                chunks touched by the ranges of plaintext in "
+              "LIST, lines of a\n"
+              "                decimal offset and length, taking them from "
+              "infile, the whole\n"
+              "                new plaintext.\n"
+              "  --follow      Keep reading infile as it grows until "
+              "interrupted (or, if it's\n"
+              "                not a regular file, until its end), sealing "
+              "what there is every\n"
+              "                so often and ending the output with a trailer. "
+              "The output\n"
+              "                format differs, and can only be decrypted in "
+              "order.\n"
+              "                With -d, wait for a growing infile to have "
+              "whole chunks and\n"
+              "                decrypt them as they come, failing if any don't "
+              "open, until it's\n"
+              "                --follow-size octets long, its trailer is read, "
+              "or it hasn't\n"
+              "                grown for --follow-timeout seconds (default: "
+              "%d).\n"
+              "  --flush-after=S, --flush-size=N\n"
+              "                With --follow, seal what there is once some of "
+              "it has waited S\n"
+              "                seconds (default: %d) or there are N octets of "
+              "it (default: a\n"
+              "                whole chunk, %d).\n"
+              "  --records=R   Seal records, R being lines or lengths "
+              "(each preceded by its\n"
+              "                length as a 4-octet big-endian integer), as "
+              "soon as they come,\n"
+              "                in the same output format as --follow.\n"
+              "  --tee=FILE    Also write the output to FILE, which may be "
+              "/dev/fd/N. May be\n"
+              "                given up to %d times. Each is written on a "
+              "thread of its own.\n"
+              "  --tee-lag=N   Let each output fall up to N chunks further "
+              "behind the others\n"
+              "                (default: %d) before the slowest holds them "
+              "up.\n"
+              "  --plain-digest=H, --cipher-digest=H\n"
+              "                Hash the plaintext or the encrypted file with "
+              "H, blake2b or\n"
+              "                sha256, as a tree: the root is the hash of the "
+              "hashes of the\n"
+              "                chunks (of the header and the boxes, for the "
+              "encrypted file),\n"
+              "                which -d on the same file also gets.\n"
+              "  --digest-file=FILE\n"
+              "                Write the digests to FILE rather than "
+              "stderr.\n"
+              "  --merkle      End the output with a tree over the chunks' "
+              "tags, its root sealed.\n"
+              "                -d then checks every chunk against it, missing "
+              "ones included, and\n"
+              "                needs infile to be a regular file or block "
+              "device.\n"
+              "  --store=DIR   Put the chunks in DIR, each named after a keyed "
+              "hash of its\n"
+              "                plaintext and written only if not there "
+              "already, and output just\n"
+              "                a manifest of them. -d of the manifest reads "
+              "them back, -q at a\n"
+              "                time. Only chunks under the same key are "
+              "shared, so the first\n"
+              "                output leaves its header in DIR for the rest to "
+              "take the salt\n"
+              "                from, along with logM, t, and p: those given "
+              "to later outputs must\n"
+              "                match it.\n"
+              "  --show-tree=D Write the nodes D levels below the root of the "
+              "--merkle tree, and\n"
+              "                the chunks under each, where the digests go. "
+              "Where two copies'\n"
+              "                differ, -d --chunk-range can check "
+              "those chunks alone.\n"
+              "  --volume-size=N\n"
+              "                Split the output into volumes of at most N "
+              "octets, at least %zu,\n"
+              "                named after -o with .000, .001, and so on "
+              "added. Each holds\n"
+              "                whole chunks, written straight into it, and "
+              "concatenated they\n"
+              "                form the whole encrypted file.\n"
+              "  --volume-dir=DIR\n"
+              "                Put volume i in the (i mod K)th of the K "
+              "--volume-dir given,\n"
+              "                under the name -o has there. May be given up to "
+              "%d times.\n",
+              FOLLOW_TIMEOUT, FLUSH_AFTER, CHUNKLEN, MAX_TEES, TEE_LAG,
+              HEADERLEN + BUFLEN, MAX_VOLUME_DIRS);
+      fprintf(stderr,
+              "  --volumes     With -d, read infile.000, infile.001, and so "
+              "on, as one, -q\n"
+              "                chunks at a time from wherever they are.\n"
+              "  --transcode   Take infile to be encrypted, and seal each of "
+              "its chunks again\n"
+              "                as it's opened, under the password on stdin "
+              "and the argon2\n"
+              "                parameters and salt given, in one pass. A "
+              "--merkle infile's\n"
+              "                tree is checked, but only kept with --merkle.\n"
+              "  --old-password=FILE\n"
+              "                Open infile with the password in FILE, which "
+              "may be /dev/fd/N,\n"
+              "                rather than the one on stdin.\n"
+              "  --mount=DIR   With -d, instead of decrypting infile, mount "
+              "it read-only at DIR\n"
+              "                with FUSE, as one file named as infile whose "
+              "reads open only the\n"
+              "                chunks they cover, on -j threads. Stops once "
+              "DIR is unmounted or\n"
+              "                on SIGINT or SIGTERM.\n"
+              "  --mount-cache=N\n"
+              "                Keep the last N chunks --mount opened (default: "
+              "%d, and more than\n"
+              "                twice -j), opening the next ahead of "
+              "sequential reads.\n"
+              "  --mount-map   Serve --mount's reads from a mapping of all of "
+              "infile's plaintext,\n"
+              "                whose pages are opened into as they're "
+              "touched. Only the last\n"
+              "                --mount-cache chunks filled keep theirs.\n"
+              "  --shared-cache=NAME\n"
+              "                With -d or --transcode, look up chunks in and "
+              "add those that open to\n"
+              "                the shared memory NAME before opening them, so "
+              "that others doing\n"
+              "                the same with it needn't. NAME "
+              "is removed when the last of\n"
+              "                them exits, though not if it's killed.\n"
+              "  --shared-cache-size=N\n"
+              "                If --shared-cache has to create NAME, give it "
+              "room for N chunks\n"
+              "                (default: %d).\n"
+              "  --send=SOCKET Instead of to stdout, write the output into "
+              "memory and, once done,\n"
+              "                seal it and pass its fd over the Unix socket "
+              "SOCKET along with its\n"
+              "                length, as an 8-octet big-endian integer. "
+              "Not with -d, since that\n"
+              "                memory could be swapped out.\n"
+              "  --connect=HOST:PORT\n"
+              "                Instead of to stdout, send the output over TCP "
+              "to HOST:PORT, the\n"
+              "                chunks with MSG_ZEROCOPY where the kernel "
+              "supports it.\n",
+              MOUNT_CACHE, SHARED_CACHE);
       return 2;
    }
 
-   FILE *input = fopen(argv[1], "r");
+   if (ioprio >= 0
+    && syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, ioprio) < 0)
+   {
+      perror("Couldn't set I/O priority");
+      return 3;
+   }
+
+   struct volumes volumes = {
+      .prefix = decrypting ? args[0] : output,
+      .dirs = volume_dirs,
+      .ndirs = nvolume_dirs,
+      .per_volume = volume_size ? (volume_size - HEADERLEN) / BUFLEN : 0,
+   };
+   char first_volume[PATH_MAX];
+   volume_path(first_volume, &volumes, 0);
+
+   FILE *input = fopen(from_volumes ? first_volume : args[0], "r");
    if (!input) {
       perror("Couldn't open input file");
       return 1;
@@ -103,31 +4758,159 @@ int main(int argc, char **argv) {
       return 3;
    }
 
-   unsigned char *ibuf = malloc(BUFLEN),
-                 *obuf = malloc(BUFLEN);
-   if (!ibuf || !obuf) {
-      perror("Couldn't malloc buffers");
-      return 4;
+   // A growing input might not even have its header yet.
+   if (following && decrypting && S_ISREG(st.st_mode)) {
+      const struct timespec ts = {.tv_nsec = FOLLOW_POLL};
+      for (double waited = 0;
+           st.st_size < (off_t)HEADERLEN && waited < follow_timeout;
+           waited += FOLLOW_POLL / 1e9)
+      {
+         nanosleep(&ts, NULL);
+         if (fstat(fileno(input), &st))
+            break;
+      }
    }
 
-   memcpy(obuf, crypto_secretbox_PRIMITIVE, sizeof crypto_secretbox_PRIMITIVE);
+   if (output) {
+      const int fd = open(volume_size ? first_volume : output,
+                          resuming || appending || patch
+                             ? O_RDWR : O_WRONLY | O_CREAT | O_TRUNC,
+                          0666);
+      if (fd < 0 || dup2(fd, STDOUT_FILENO) < 0) {
+         perror("Couldn't open output file");
+         return 1;
+      }
+      if (fd != STDOUT_FILENO)
+         close(fd);
+   }
 
-   // Obfuscate it a bit.
-   for (size_t i = 0; i < sizeof crypto_secretbox_PRIMITIVE; ++i)
-      obuf[i] ^= (uint8_t)(0xeeU + (i << 5));
+   // The output is written into memory as into any regular file, to be
+   // handed over whole once done.
+   int send_sock = -1;
+   if (send_to) {
+      if ((send_sock = connect_send(send_to)) < 0)
+         return 1;
+      const int fd = memfd_create("naclypt", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+      if (fd < 0 || dup2(fd, STDOUT_FILENO) < 0) {
+         perror("Couldn't create output memfd");
+         return 1;
+      }
+      close(fd);
+   }
+
+   // Without MSG_ZEROCOPY, the socket is written to like a pipe.
+   bool zerocopy = false;
+   unsigned char *zc_acked = NULL;
+   if (connect_to) {
+      const int fd = connect_tcp(connect_to), one = 1;
+      if (fd < 0 || dup2(fd, STDOUT_FILENO) < 0) {
+         if (fd >= 0)
+            perror("Couldn't connect stdout");
+         return 1;
+      }
+      if (fd != STDOUT_FILENO)
+         close(fd);
+      zerocopy = !setsockopt(STDOUT_FILENO, SOL_SOCKET, SO_ZEROCOPY, &one,
+                             sizeof one);
+      if (zerocopy && !(zc_acked = calloc(ZEROCOPY_WINDOW, 1))) {
+         perror("Couldn't malloc buffers");
+         return 4;
+      }
+      if (!zerocopy && verbose)
+         perror("Not using MSG_ZEROCOPY");
+   }
+   for (size_t i = 0; i < ntees; ++i) {
+      if ((tees[i].fd = open(tees[i].name, O_WRONLY | O_CREAT | O_TRUNC,
+                             0666)) < 0)
+      {
+         fprintf(stderr, "Couldn't open %s: %s\n", tees[i].name,
+                 strerror(errno));
+         return 1;
+      }
+   }
+   if (checkpoint
+    && (fstat(STDOUT_FILENO, &st) || !S_ISREG(st.st_mode)
+     || fcntl(STDOUT_FILENO, F_GETFL) & O_APPEND))
+   {
+      fputs("--checkpoint needs stdout to be a regular file, not opened for "
+            "appending\n", stderr);
+      return 1;
+   }
+
+   unsigned char ibuf[sizeof crypto_secretbox_PRIMITIVE],
+                 obuf[sizeof crypto_secretbox_PRIMITIVE];
+   make_magic(obuf);
+
+   // The flags of what we write, or of what we read.
+   unsigned flags = FLAG_CHUNK_NONCES
+                  | (following || records ? FLAG_FRAMED : 0)
+                  | (merkle ? FLAG_MERKLE : 0)
+                  | (store ? FLAG_STORE : 0);
+   if (!decrypting)
+      obuf[sizeof obuf - 1] ^= (uint8_t)flags;
+
+   // The header as it is or would be in the output, for --checkpoint.
+   unsigned char header_octets[HEADERLEN];
+   size_t header_len = sizeof obuf;
+   memcpy(header_octets, obuf, sizeof obuf);
+
+   // Where to read the header from, if not generating one, and whether to
+   // write it out.
+   FILE *header = decrypting ? input : NULL;
+   const char *header_name = "input";
+   const bool write_header =
+      !decrypting && !first_chunk && !resuming && !appending && !patch;
+   if (salt_from) {
+      if (!(header = fopen(salt_from, "r"))) {
+         perror("Couldn't open salt file");
+         return 1;
+      }
+      header_name = salt_from;
+   }
 
-   if (decrypting) {
-      if (read_full(input, ibuf, sizeof crypto_secretbox_PRIMITIVE)
+   if (header) {
+      if (read_full(header, ibuf, sizeof crypto_secretbox_PRIMITIVE)
           != sizeof crypto_secretbox_PRIMITIVE)
       {
-         fprintf(stderr, "Invalid input: couldn't read magic\n");
+         fprintf(stderr, "Invalid %s: couldn't read magic\n", header_name);
          return 1;
       }
-      if (memcmp(ibuf, obuf, sizeof crypto_secretbox_PRIMITIVE)) {
-         fprintf(stderr, "Invalid input: bad magic (maybe bad libsodium)\n");
+      if (memcmp(ibuf, obuf, sizeof crypto_secretbox_PRIMITIVE - 1)) {
+         fprintf(stderr, "Invalid %s: bad magic (maybe bad libsodium)\n",
+                 header_name);
          return 1;
       }
-   } else {
+      if (decrypting)
+         memcpy(header_octets, ibuf, sizeof ibuf);
+      const unsigned header_flags = ibuf[sizeof ibuf - 1]
+                                  ^ obuf[sizeof obuf - 1]
+                                  ^ (decrypting ? 0 : flags);
+      if (header_flags & ~KNOWN_FLAGS) {
+         fprintf(stderr, "Invalid %s: unknown format flags %#x (maybe from a "
+                         "newer version)\n", header_name, header_flags);
+         return 1;
+      }
+      if ((resuming || appending || patch)
+       && header_flags != FLAG_CHUNK_NONCES)
+      {
+         fprintf(stderr, "Can't add to %s: it's in another format\n",
+                 header_name);
+         return 1;
+      }
+      if (decrypting)
+         flags = header_flags;
+   }
+   if (decrypting && !store != !(flags & FLAG_STORE)) {
+      fputs(store ? "Invalid input: it's not a --store manifest\n"
+                  : "Input is a --store manifest: -d needs the --store\n",
+            stderr);
+      return store ? 1 : 2;
+   }
+   if (decrypting && show_tree >= 0 && !(flags & FLAG_MERKLE)) {
+      fputs("Invalid input: it has no tree to show\n", stderr);
+      return 1;
+   }
+   if (write_header) {
       if (write_full(stdout, obuf, sizeof crypto_secretbox_PRIMITIVE)
           != sizeof crypto_secretbox_PRIMITIVE)
       {
@@ -140,10 +4923,10 @@ int main(int argc, char **argv) {
    uint32_t argon2_t, argon2_parallelism;
 
 #define get_argon2_param(X, argv_idx, unacceptable, range) do { \
-   if (decrypting) { \
-      uint8_t buf[sizeof argon2_##X]; \
-      if (read_full(input, buf, sizeof buf) != sizeof buf) { \
-         fprintf(stderr, "Invalid input: couldn't read " #X "\n"); \
+   uint8_t buf[sizeof argon2_##X]; \
+   if (header) { \
+      if (read_full(header, buf, sizeof buf) != sizeof buf) { \
+         fprintf(stderr, "Invalid %s: couldn't read " #X "\n", header_name); \
          return 1; \
       } \
       argon2_##X = 0; \
@@ -151,37 +4934,45 @@ int main(int argc, char **argv) {
          argon2_##X <<= sizeof argon2_##X > 1 ? 8 : 0; \
          argon2_##X += buf[i]; \
       } \
+      char *end; \
+      if (check_args && (strtoul(args[argv_idx], &end, 10) != argon2_##X \
+                         || *end || !*args[argv_idx])) \
+      { \
+         fprintf(stderr, #X " doesn't match that in %s\n", header_name); \
+         return 2; \
+      } \
    } else { \
       char *end; \
       argon2_##X = \
          _Generic(argon2_##X, \
-                  uint8_t:  (uint8_t) strtoul(argv[argv_idx], &end, 10), \
-                  uint32_t: (uint32_t)strtoul(argv[argv_idx], &end, 10)); \
-      if (*end || !*argv[argv_idx]) \
+                  uint8_t:  (uint8_t) strtoul(args[argv_idx], &end, 10), \
+                  uint32_t: (uint32_t)strtoul(args[argv_idx], &end, 10)); \
+      if (*end || !*args[argv_idx]) \
          goto bad_##X; \
-      uint8_t buf[sizeof argon2_##X]; \
       for (uint32_t n = argon2_##X, i = sizeof argon2_##X; i--;) { \
          buf[i] = (uint8_t)n; \
          n >>= 8; \
       } \
-      if (write_full(stdout, buf, sizeof buf) != sizeof buf) { \
-         fprintf(stderr, "Couldn't write " #X " to stdout\n"); \
-         return 1; \
-      } \
    } \
    if (unacceptable) { \
 bad_##X: \
       fprintf(stderr, "Invalid " #X ": should be a decimal integer in the " \
                       "range " range "\n"); \
-      return decrypting ? 1 : 2; \
+      return header ? 1 : 2; \
    } \
+   if (write_header && write_full(stdout, buf, sizeof buf) != sizeof buf) { \
+      fprintf(stderr, "Couldn't write " #X " to stdout\n"); \
+      return 1; \
+   } \
+   memcpy(header_octets + header_len, buf, sizeof buf); \
+   header_len += sizeof buf; \
 } while (0)
 
-   get_argon2_param(logm, 2, argon2_logm < 2 || argon2_logm >= 32, "[2, 32)");
+   get_argon2_param(logm, 1, argon2_logm < 2 || argon2_logm >= 32, "[2, 32)");
 
    // Empirically validated ranges using the argon2 CLI.
-   get_argon2_param(t, 3, !argon2_t, "[1, 2^32)");
-   get_argon2_param(parallelism, 4, !argon2_parallelism || argon2_parallelism >= 1ul << 24u, "[1, 2^24)");
+   get_argon2_param(t, 2, !argon2_t, "[1, 2^32)");
+   get_argon2_param(parallelism, 3, !argon2_parallelism || argon2_parallelism >= 1ul << 24u, "[1, 2^24)");
    if ((uint64_t)1 << argon2_logm < (uint64_t)argon2_parallelism * 8) {
       fprintf(stderr, "Invalid logM %" PRIu8 " and p %" PRIu32 ":\n"
                       "8 KiB is needed for each level of parallelism\n",
@@ -206,18 +4997,63 @@ bad_##X: \
    }
 
    unsigned char salt[crypto_secretbox_KEYBYTES];
-   if (decrypting) {
-      if (read_full(input, salt, sizeof salt) != sizeof salt) {
-         fprintf(stderr, "Invalid input: couldn't read salt\n");
+   if (header) {
+      if (read_full(header, salt, sizeof salt) != sizeof salt) {
+         fprintf(stderr, "Invalid %s: couldn't read salt\n", header_name);
          return 1;
       }
-   } else {
-      if (read_full(urandom, salt, sizeof salt) != sizeof salt) {
-         fprintf(stderr, "/dev/urandom failed to provide\n");
-         return 3;
+   } else if (read_full(urandom, salt, sizeof salt) != sizeof salt) {
+      fprintf(stderr, "/dev/urandom failed to provide\n");
+      return 3;
+   }
+   if (write_header && write_full(stdout, salt, sizeof salt) != sizeof salt) {
+      fprintf(stderr, "Couldn't write salt to stdout\n");
+      return 1;
+   }
+   memcpy(header_octets + header_len, salt, sizeof salt);
+   for (size_t i = 0; write_header && i < ntees; ++i) {
+      if (write_fd_full(tees[i].fd, header_octets, sizeof header_octets)
+          != sizeof header_octets)
+      {
+         fprintf(stderr, "Couldn't write header to %s: %s\n", tees[i].name,
+                 strerror(errno));
+         return 1;
+      }
+   }
+
+   if (store && !decrypting && salt_from != store_header) {
+      if (mkdir(store, 0777) && errno != EEXIST) {
+         perror("Couldn't create store");
+         return 1;
+      }
+      const int fd = open(store_header, O_WRONLY | O_CREAT | O_EXCL, 0666);
+      if (fd >= 0) {
+         const bool ok = write_fd_full(fd, header_octets, sizeof header_octets)
+                         == sizeof header_octets;
+         if (close(fd) || !ok) {
+            perror("Couldn't write the store's header");
+            return 1;
+         }
+      } else if (errno != EEXIST) {
+         perror("Couldn't create the store's header");
+         return 1;
       }
-      if (write_full(stdout, salt, sizeof salt) != sizeof salt) {
-         fprintf(stderr, "Couldn't write salt to stdout\n");
+   }
+
+   unsigned char header_hash[crypto_generichash_BYTES];
+   crypto_generichash(header_hash, sizeof header_hash, header_octets,
+                      sizeof header_octets, NULL, 0);
+
+   // Before asking for the password, make sure there's something to resume.
+   unsigned char resume_hash[crypto_generichash_BYTES],
+                 resume_nonce[crypto_secretbox_NONCEBYTES];
+   uint_fast64_t resume_chunks;
+   if (resuming) {
+      if (!load_checkpoint(checkpoint, resume_hash, resume_nonce,
+                           &resume_chunks))
+         return 1;
+      if (memcmp(resume_hash, header_hash, sizeof header_hash)) {
+         fputs("Checkpoint is for some other output\n", stderr);
          return 1;
       }
    }
@@ -231,6 +5067,46 @@ bad_##X: \
 
    unsigned char key[crypto_secretbox_KEYBYTES];
 
+   // The lanes are part of the output format but how many threads run them
+   // isn't, so don't run more than we have CPUs for.
+   const size_t cpus = usable_cpus(verbose);
+   if (!jobs) {
+      jobs = cpus < DEFAULT_JOBS ? cpus : DEFAULT_JOBS;
+      // Nor more than can be mlocked, unless we're exempt.
+      struct rlimit lock;
+      if (geteuid() && !getrlimit(RLIMIT_MEMLOCK, &lock)
+       && lock.rlim_cur != RLIM_INFINITY
+       && lock.rlim_cur / (4 * BUFLEN) < jobs)
+         jobs = lock.rlim_cur < 4 * BUFLEN ? 1 : lock.rlim_cur / (4 * BUFLEN);
+   }
+   const uint32_t argon2_threads =
+      argon2_parallelism < cpus ? argon2_parallelism : (uint32_t)cpus;
+   if (verbose)
+      fprintf(stderr, "Using %lu workers and %" PRIu32 " argon2 threads\n",
+              jobs, argon2_threads);
+
+   // The key infile was encrypted under, before the password is cleared.
+   unsigned char transcode_key[crypto_secretbox_KEYBYTES];
+   unsigned transcode_flags = 0;
+   if (transcode) {
+      uint8_t old[sizeof password];
+      uint32_t oldlen = pwlen;
+      if (old_password) {
+         FILE *f = fopen(old_password, "r");
+         if (!f) {
+            perror("Couldn't open old password file");
+            return 1;
+         }
+         oldlen = (uint32_t)read_full(f, old, sizeof old);
+         fclose(f);
+      }
+      const int status = old_key(input, old_password ? old : password, oldlen,
+                                 old_password, cpus, transcode_key,
+                                 &transcode_flags);
+      if (status)
+         return status;
+   }
+
    argon2_context argon2_ctx = {
       .out = key,
       .outlen = sizeof key,
@@ -245,97 +5121,311 @@ bad_##X: \
       .t_cost = argon2_t,
       .m_cost = (uint32_t)1 << argon2_logm,
       .lanes = argon2_parallelism,
-      .threads = argon2_parallelism,
+      .threads = argon2_threads,
       .version = ARGON2_VERSION_13,
       .allocate_cbk = NULL,
       .free_cbk = NULL,
       .flags = ARGON2_FLAG_CLEAR_PASSWORD,
    };
 
+   struct node *nodes = NULL;
+   const size_t nnodes = numa ? find_nodes(&nodes) : 0;
+   if (numa && verbose && !nnodes)
+      fputs("Only one NUMA node to run on, not placing anything\n", stderr);
+
+   // libargon2 runs its lanes on threads of its own, which we can't place,
+   // but we can keep them all from contending for the one node's memory.
+   if (nnodes) {
+      set_policy(MPOL_INTERLEAVE, nodes, nnodes);
+      if (verbose)
+         fprintf(stderr, "Interleaving argon2 memory over %zu NUMA nodes\n",
+                 nnodes);
+   }
    const int argon2_status = argon2i_ctx(&argon2_ctx);
+   if (nnodes)
+      set_policy(MPOL_DEFAULT, NULL, 0);
    if (argon2_status != ARGON2_OK) {
       fprintf(stderr, "argon2i failed: %s\n",
               argon2_error_message(argon2_status));
       return 6;
    }
 
-   unsigned char nonce[crypto_secretbox_NONCEBYTES];
-   memset(nonce, 0, sizeof nonce);
+   struct engine e = {
+      .lock = PTHREAD_MUTEX_INITIALIZER,
+      .cond = PTHREAD_COND_INITIALIZER,
+      .decrypting = decrypting || transcode,
+      .chunk_nonces = (transcode ? transcode_flags : flags)
+                    & FLAG_CHUNK_NONCES,
+      .framed = flags & FLAG_FRAMED,
+      .merkle = merkle,
+      .deterministic = deterministic,
+      .store = store,
+      .records = records,
+      .plain_digest = {.alg = plain_digest},
+      .cipher_digest = {.alg = cipher_digest},
+      .tees = tees,
+      .ntees = ntees,
+      .tee_lag = tee_lag,
+      .follow = following ? args[0] : NULL,
+      .flush_size = flush_size,
+      .flush_after = (uint_fast64_t)(flush_after * 1e9),
+      .follow_size = (off_t)follow_size,
+      .follow_timeout = (uint_fast64_t)(follow_timeout * 1e9),
+      .verbose = verbose,
+      .drop_cache = drop_cache,
+      .key = transcode ? transcode_key : key,
+      .reseal_key = transcode ? key : NULL,
+      .checkpoint = checkpoint,
+      .checkpoint_every = checkpoint_every,
+      .nodes = nodes,
+      .nnodes = nnodes,
+      .out_base = -1,
+      .read_throttle = {
+         .lock = PTHREAD_MUTEX_INITIALIZER,
+         .rate = read_rate / 1000,
+      },
+      .write_throttle = {
+         .lock = PTHREAD_MUTEX_INITIALIZER,
+         .rate = write_rate / 1000,
+      },
+      .urandom = urandom,
+      .written = first_chunk,
+      .first_idx = first_chunk,
+      .next_idx = first_chunk,
+      .end_idx = end_chunk,
+      .total_read = first_chunk * CHUNKLEN,
+   };
 
-   uint_fast64_t total_read = 0;
-   int_fast32_t new_nonce_in = 0;
+   if (deterministic || store) {
+      static const char context[] = "naclypt deterministic nonces";
+      crypto_generichash(e.nonce_key, sizeof e.nonce_key,
+                         (const unsigned char *)context, sizeof context - 1,
+                         key, sizeof key);
+   }
+   if (store) {
+      static const char context[] = "naclypt store ids";
+      crypto_generichash(e.id_key, sizeof e.id_key,
+                         (const unsigned char *)context, sizeof context - 1,
+                         key, sizeof key);
+   }
 
-   const size_t ioffset = decrypting ? 0 : crypto_secretbox_ZEROBYTES;
-   const size_t ooffset = decrypting ? crypto_secretbox_ZEROBYTES : 0;
-   const size_t isize = BUFLEN - ioffset;
-   if (!decrypting)
-      memset(ibuf, 0, ioffset);
+   // Write chunks straight into place if we can. Not with O_APPEND, under
+   // which pwrite ignores the offset, nor when framed, where they have no
+   // fixed place, nor into a store, where they have none in stdout.
+   if (!e.framed && !(store && !decrypting)
+    && !fstat(STDOUT_FILENO, &st) && S_ISREG(st.st_mode)
+    && !(fcntl(STDOUT_FILENO, F_GETFL) & O_APPEND) && !fflush(stdout))
+      e.out_base = lseek(STDOUT_FILENO, 0, SEEK_CUR);
 
-   for (;;) {
-      // read_full is important so that we get the zero bytes when we expect
-      // them (during decryption) and we output them at the right time (during
-      // encryption).
-      size_t r = read_full(input, ibuf + ioffset, isize);
-      if (UNLIKELY(!r))
-         return 0;
+   // Volumes after the first are opened as the chunks going in them come.
+   if (volume_size) {
+      if (e.out_base < 0) {
+         fputs("--volume-size needs -o to name a regular file or block "
+               "device\n", stderr);
+         return 1;
+      }
+      if (!(volumes.fds = malloc(sizeof *volumes.fds))) {
+         perror("Couldn't malloc volumes");
+         return 4;
+      }
+      volumes.fds[0] = STDOUT_FILENO;
+      volumes.n = volumes.cap = 1;
+      volumes.base = e.out_base;
+      e.volumes = &volumes;
+   }
 
-      if (decrypting && UNLIKELY(r <= ooffset)) {
-         fprintf(stderr, "Invalid input: expected at least %zu octets after "
-                         "%#zx, got only %zu\n", ooffset, total_read, r);
-         return 11;
+   // Likewise read them from wherever they are, if we can. Not when appending,
+   // where the plaintext carried over comes before infile, which then isn't
+   // where the chunk indices suggest. A --store manifest's chunks are read from
+   // the store, as many at once.
+   if (!appending && !e.framed && !following && !(store && decrypting)
+    && !fstat(fileno(input), &st)
+    && (S_ISREG(st.st_mode) || S_ISBLK(st.st_mode))
+    && (e.in_base = ftello(input)) >= 0
+    && (e.in_end = lseek(fileno(input), 0, SEEK_END)) >= 0)
+   {
+      e.in_fd = fileno(input);
+      if (!depth)
+         depth = jobs;
+   } else if (store && decrypting) {
+      const int status = open_manifest(&e, input);
+      if (status)
+         return status;
+      if (!depth)
+         depth = jobs;
+   } else if (first_chunk || resuming || patch || from_volumes || mount_dir
+           || (decrypting ? flags : transcode_flags) & FLAG_MERKLE)
+   {
+      fputs("--chunk-range, --resume, --patch, --volumes, --mount, and -d of "
+            "a --merkle input\nneed infile to be a regular file or block "
+            "device\n", stderr);
+      return 1;
+   } else {
+      depth = 0;
+   }
+   if (from_volumes) {
+      e.volumes = &volumes;
+      const int status = open_volumes(&e);
+      if (status)
+         return status;
+   }
+   memcpy(e.header_hash, header_hash, sizeof header_hash);
+
+   static struct shared shared;
+   if (shared_cache) {
+      const int status = shared_open(&shared, shared_cache,
+                                     shared_cache_size);
+      if (status)
+         return status;
+      e.shared = &shared;
+   }
+   e.zerocopy = zerocopy;
+   e.zc_acked = zc_acked;
+
+   unsigned char *trailer = NULL;
+   size_t trailer_len = 0;
+   if (decrypting && flags & FLAG_MERKLE) {
+      const int status = read_tree(&e, &trailer, &trailer_len);
+      if (status)
+         return status;
+   }
+
+   // The tree of a --merkle input to --transcode is checked as with -d, but
+   // isn't part of the output.
+   if (transcode && transcode_flags & FLAG_MERKLE) {
+      unsigned char *old_trailer;
+      size_t old_len;
+      const int status = read_tree(&e, &old_trailer, &old_len);
+      if (status)
+         return status;
+   }
+
+   // Decrypting from chunk A on needs the nonce it's under.
+   if (decrypting && first_chunk) {
+      uint_fast64_t start;
+      if (!find_prefix(e.in_fd, e.in_base, first_chunk, e.nonce, &start)) {
+         perror("Couldn't read input");
+         return 1;
       }
+      fill_in_nonce(e.nonce, start * CHUNKLEN);
+      if (!e.chunk_nonces)
+         e.new_nonce_in =
+            INT32_MAX - (int_fast32_t)((first_chunk - start - 1) * CHUNKLEN);
+   }
 
-      const bool need_new_nonce = new_nonce_in <= 0;
+   if (resuming && !resume(&e, resume_chunks, resume_nonce))
+      return 1;
 
-      if (decrypting) {
-         if (UNLIKELY(need_new_nonce)) {
-            memcpy(nonce, ibuf, NONCE_RANDOMS);
-            fill_in_nonce(nonce, total_read);
-            memset(ibuf, 0, NONCE_RANDOMS);
-         } else {
-            for (size_t i = 0; i < crypto_secretbox_BOXZEROBYTES; ++i) {
-               if (LIKELY(!ibuf[i]))
-                  continue;
-               fprintf(stderr, "Invalid input: octet %#" PRIxFAST64 " should "
-                               "have been zero, not %#x\n",
-                               total_read + i, ibuf[i]);
-               return 11;
-            }
-         }
+   if (appending) {
+      const int status = prepare_append(&e);
+      if (status)
+         return status;
+   }
+   if (patch) {
+      const int status = prepare_patch(&e, patch);
+      if (status)
+         return status;
+   }
 
-         (void) crypto_secretbox_open(obuf, ibuf, r, nonce, key);
-         r -= ooffset;
-         total_read += r;
-         new_nonce_in -= (int_fast32_t)r;
+   // Each thread may hold two chunks, and there must be one more for it to
+   // open another into.
+   if (mount_dir) {
+      const char *slash = strrchr(args[0], '/');
+      return run_mount(&e, mount_dir, slash ? slash + 1 : args[0], jobs,
+                       mount_cache > 2 * jobs ? mount_cache : 2 * jobs + 1,
+                       mount_map);
+   }
 
-      } else {
-         if (UNLIKELY(need_new_nonce)) {
-            if (UNLIKELY(read_full(urandom, nonce, NONCE_RANDOMS)
-                         != NONCE_RANDOMS))
-            {
-               fputs("/dev/urandom failed to provide\n", stderr);
-               return 3;
-            }
-            fill_in_nonce(nonce, total_read);
-         }
+   digest_start(&e.plain_digest);
+   digest_start(&e.cipher_digest);
+   if (cipher_digest && !first_chunk && (write_header || decrypting)) {
+      unsigned char leaf[DIGESTLEN];
+      digest_leaf(&e.cipher_digest, leaf, header_octets,
+                  sizeof header_octets);
+      digest_add(&e.cipher_digest, leaf);
+   }
 
-         new_nonce_in -= (int_fast32_t)r;
-         total_read += r;
-         r += ioffset;
-         crypto_secretbox(obuf, ibuf, r, nonce, key);
+   int status = run_engine(&e, jobs, depth, input);
 
-         if (UNLIKELY(need_new_nonce))
-            memcpy(obuf, nonce, NONCE_RANDOMS);
+   if (!status && store && !decrypting) {
+      status = seal_manifest(&e);
+      if (verbose) {
+         fprintf(stderr, "%" PRIuFAST64 " of %" PRIuFAST64 " chunks were new "
+                         "to the store\n", e.stored, e.written);
+      }
+   }
+   // Any volumes after the last are left over from some earlier, longer
+   // output, and would be taken for part of this one.
+   if (!status && volume_size) {
+      char path[PATH_MAX];
+      for (size_t i = volumes.n;; ++i) {
+         volume_path(path, &volumes, i);
+         if (unlink(path))
+            break;
+      }
+      if (verbose)
+         fprintf(stderr, "Wrote %zu volumes\n", volumes.n);
+   }
+   if (zerocopy && verbose) {
+      fprintf(stderr, "%" PRIuFAST64 " of %" PRIuFAST64 " zero-copy sends "
+                      "were copied after all\n", e.zc_copied, e.zc_sent);
+   }
+   if (!status && merkle) {
+      e.key = key;  // Not the one infile was opened with, for --transcode.
+      status = seal_tree(&e, &trailer, &trailer_len);
+      if (!status && write_full(stdout, trailer, trailer_len) != trailer_len) {
+         fputs("Couldn't write the tree to stdout\n", stderr);
+         status = 1;
+      }
+      for (size_t i = 0; !status && i < ntees; ++i) {
+         if (write_fd_full(tees[i].fd, trailer, trailer_len) != trailer_len) {
+            fprintf(stderr, "Couldn't write the tree to %s: %s\n",
+                    tees[i].name, strerror(errno));
+            status = 1;
+         }
       }
+   }
+   if (trailer && cipher_digest && end_chunk == UINT_FAST64_MAX
+    && !first_chunk)
+   {
+      unsigned char leaf[DIGESTLEN];
+      digest_leaf(&e.cipher_digest, leaf, trailer, trailer_len);
+      digest_add(&e.cipher_digest, leaf);
+   }
 
-      if (UNLIKELY(write_full(stdout, obuf + ooffset, r) != r)) {
-         fputs("Couldn't write ciphertext to stdout\n", stderr);
+   if (!status && (plain_digest || cipher_digest || show_tree >= 0)) {
+      FILE *f = digest_file ? fopen(digest_file, "w") : stderr;
+      if (!f) {
+         perror("Couldn't open digest file");
          return 1;
       }
-
-      if (UNLIKELY(need_new_nonce)) {
-         // Arbitrary value but must be greater than BUFLEN.
-         new_nonce_in = INT32_MAX;
+      struct digest *const digests[] = {&e.plain_digest, &e.cipher_digest};
+      for (size_t i = 0; i < 2; ++i) {
+         if (!digests[i]->alg)
+            continue;
+         unsigned char root[DIGESTLEN];
+         char name[64];
+         digest_end(digests[i], root);
+         snprintf(name, sizeof name, "%s %s-tree",
+                  i ? "ciphertext" : "plaintext",
+                  digest_names[digests[i]->alg]);
+         put_hex(f, name, root, sizeof root);
+      }
+      if (show_tree >= 0) {
+         print_tree(f, trailer, get_be64(trailer + trailer_len - 8),
+                    (unsigned long long)show_tree);
+      }
+      if (digest_file && fclose(f)) {
+         perror("Couldn't write digest file");
+         status = 1;
       }
    }
+
+   if (!status && send_to)
+      status = send_output(send_sock);
+
+   // A leftover checkpoint would only invite resuming a finished run.
+   if (!status && checkpoint && unlink(checkpoint))
+      perror("Couldn't remove checkpoint");
+   return status;
 }